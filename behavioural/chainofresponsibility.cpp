@@ -4,17 +4,64 @@ Chain of Responsibility is behavioral design pattern that allows passing request
 The pattern allows multiple objects to handle the request without coupling sender class to the concrete classes of the receivers.
 The chain can be composed dynamically at runtime with any handler that follows a standard handler interface.
 */
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 /**
  * The Handler interface declares a method for building the chain of handlers.
  * It also declares a method for executing a request.
+ *
+ * HandleInto only views the request and appends the response to a buffer owned
+ * by the caller, so passing a request down the chain copies nothing and a
+ * reused buffer stops allocating once it is large enough. It returns whether
+ * some handler took the request. Handle is kept as a thin wrapper for callers
+ * that want a fresh string back.
+ *
+ * HandleBatch answers a whole batch at once. Every handler claims its share of
+ * the requests still pending and passes only the rest on, so for handlers
+ * built on ClaimingHandler a batch costs one virtual call per handler instead
+ * of one per request and hop. The positions nobody handled come back as a
+ * compact index list. There must be a response slot for every request.
  */
 class Handler {
  public:
   virtual Handler *SetNext(Handler *handler) = 0;
-  virtual std::string Handle(std::string request) = 0;
+  virtual bool HandleInto(std::string_view request, std::string &response) = 0;
+  virtual void HandleBatchInto(std::span<const std::string_view> requests, std::span<std::string> responses,
+                               std::vector<std::size_t> &pending) = 0;
+  std::string Handle(const std::string &request) {
+    std::string response;
+    this->HandleInto(request, response);
+    return response;
+  }
+  std::vector<std::size_t> HandleBatch(std::span<const std::string_view> requests, std::span<std::string> responses) {
+    if (responses.size() < requests.size()) {
+      throw std::invalid_argument("HandleBatch: fewer responses than requests");
+    }
+    std::vector<std::size_t> pending(requests.size());
+    std::iota(pending.begin(), pending.end(), std::size_t(0));
+    this->HandleBatchInto(requests, responses, pending);
+    return pending;
+  }
 };
 /**
  * The default chaining behavior can be implemented inside a base handler class.
@@ -36,45 +83,347 @@ class AbstractHandler : public Handler {
     // $monkey->setNext($squirrel)->setNext($dog);
     return handler;
   }
-  std::string Handle(std::string request) override {
+  bool HandleInto(std::string_view request, std::string &response) override {
+    if (this->Claim(request, response)) {
+      return true;
+    }
     if (this->next_handler_) {
-      return this->next_handler_->Handle(request);
+      return this->next_handler_->HandleInto(request, response);
     }
 
+    return false;
+  }
+  void HandleBatchInto(std::span<const std::string_view> requests, std::span<std::string> responses,
+                       std::vector<std::size_t> &pending) override {
+    this->ClaimBatch(requests, responses, pending);
+    if (this->next_handler_ && !pending.empty()) {
+      this->next_handler_->HandleBatchInto(requests, responses, pending);
+    }
+  }
+  /**
+   * The handler's own decision, without passing the request on. Concrete
+   * handlers override this; the base handler takes nothing.
+   */
+  virtual bool Claim(std::string_view, std::string &) {
+    return false;
+  }
+  /**
+   * Claims this handler's share of a batch and compacts `pending` down to the
+   * requests it left. This default asks Claim through a virtual call per
+   * request; ClaimingHandler and handlers with a cheaper bulk test override it.
+   */
+  virtual void ClaimBatch(std::span<const std::string_view> requests, std::span<std::string> responses,
+                          std::vector<std::size_t> &pending) {
+    std::size_t kept = 0;
+    for (std::size_t index : pending) {
+      if (!this->Claim(requests[index], responses[index])) {
+        pending[kept++] = index;
+      }
+    }
+    pending.resize(kept);
+  }
+  /**
+   * The request keys this handler accepts. A handler that decides by something
+   * other than an exact key match returns an empty list and stays opaque to an
+   * IndexedChain.
+   */
+  virtual std::vector<std::string> Keys() const {
     return {};
   }
+
+ protected:
+  /**
+   * The ClaimBatch loop with H's own Claim called by name, so it is not a
+   * virtual call and can be inlined.
+   */
+  template <typename H>
+  static void ClaimBatchWith(H &handler, std::span<const std::string_view> requests,
+                             std::span<std::string> responses, std::vector<std::size_t> &pending) {
+    std::size_t kept = 0;
+    for (std::size_t index : pending) {
+      if (!handler.H::Claim(requests[index], responses[index])) {
+        pending[kept++] = index;
+      }
+    }
+    pending.resize(kept);
+  }
+};
+/**
+ * Concrete handlers derive through ClaimingHandler<Self>, which gives them a
+ * ClaimBatch that runs their own Claim directly.
+ */
+template <typename Derived>
+class ClaimingHandler : public AbstractHandler {
+ public:
+  void ClaimBatch(std::span<const std::string_view> requests, std::span<std::string> responses,
+                  std::vector<std::size_t> &pending) override {
+    ClaimBatchWith(static_cast<Derived &>(*this), requests, responses, pending);
+  }
 };
 /**
- * All Concrete Handlers either handle a request or pass it to the next handler
- * in the chain.
+ * All Concrete Handlers either handle a request or let AbstractHandler pass it
+ * to the next handler in the chain.
  */
-class MonkeyHandler : public AbstractHandler {
+class MonkeyHandler : public ClaimingHandler<MonkeyHandler> {
  public:
-  std::string Handle(std::string request) override {
+  std::vector<std::string> Keys() const override {
+    return {"Banana"};
+  }
+  bool Claim(std::string_view request, std::string &response) override {
     if (request == "Banana") {
-      return "Monkey: I'll eat the " + request + ".\n";
-    } else {
-      return AbstractHandler::Handle(request);
+      response.append("Monkey: I'll eat the ").append(request).append(".\n");
+      return true;
     }
+    return false;
   }
 };
-class SquirrelHandler : public AbstractHandler {
+class SquirrelHandler : public ClaimingHandler<SquirrelHandler> {
  public:
-  std::string Handle(std::string request) override {
+  std::vector<std::string> Keys() const override {
+    return {"Nut"};
+  }
+  bool Claim(std::string_view request, std::string &response) override {
     if (request == "Nut") {
-      return "Squirrel: I'll eat the " + request + ".\n";
-    } else {
-      return AbstractHandler::Handle(request);
+      response.append("Squirrel: I'll eat the ").append(request).append(".\n");
+      return true;
     }
+    return false;
   }
 };
-class DogHandler : public AbstractHandler {
+class DogHandler : public ClaimingHandler<DogHandler> {
  public:
-  std::string Handle(std::string request) override {
+  std::vector<std::string> Keys() const override {
+    return {"MeatBall"};
+  }
+  bool Claim(std::string_view request, std::string &response) override {
     if (request == "MeatBall") {
-      return "Dog: I'll eat the " + request + ".\n";
-    } else {
-      return AbstractHandler::Handle(request);
+      response.append("Dog: I'll eat the ").append(request).append(".\n");
+      return true;
+    }
+    return false;
+  }
+};
+/**
+ * A long chain walks its handlers one hop at a time, so the cost of a request
+ * grows with the position of the handler that takes it. The IndexedChain
+ * compiles the keys its handlers declare into a hash index and jumps straight
+ * to the first handler in chain order that accepts the request. Opaque
+ * handlers are still asked in order, so the "first match wins" rule of the
+ * linked chain is kept.
+ *
+ * Handlers added here must not be linked with SetNext themselves; the chain
+ * decides who is asked. The chain's own SetNext names the handler that gets
+ * the requests nobody in the chain accepted.
+ */
+class IndexedChain : public AbstractHandler {
+ private:
+  /**
+   * Transparent hashing lets the index be probed with a string_view.
+   */
+  struct KeyHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view key) const {
+      return std::hash<std::string_view>()(key);
+    }
+  };
+
+  std::vector<AbstractHandler *> handlers_;
+  std::vector<std::size_t> opaque_;
+  std::unordered_map<std::string, std::size_t, KeyHash, std::equal_to<>> index_;
+
+ public:
+  IndexedChain &Add(AbstractHandler *handler) {
+    const std::size_t position = handlers_.size();
+    handlers_.push_back(handler);
+    const std::vector<std::string> keys = handler->Keys();
+    if (keys.empty()) {
+      opaque_.push_back(position);
+    }
+    for (const std::string &key : keys) {
+      // emplace keeps the earlier handler when two of them claim the same key.
+      index_.emplace(key, position);
+    }
+    return *this;
+  }
+  bool Claim(std::string_view request, std::string &response) override {
+    const auto found = index_.find(request);
+    const std::size_t position = found == index_.end() ? handlers_.size() : found->second;
+    for (std::size_t opaque : opaque_) {
+      if (opaque > position) {
+        break;
+      }
+      if (handlers_[opaque]->HandleInto(request, response)) {
+        return true;
+      }
+    }
+    if (position < handlers_.size()) {
+      return handlers_[position]->HandleInto(request, response);
+    }
+    return false;
+  }
+};
+/**
+ * A chain that is known at build time can be spelled as a type instead, e.g.
+ * StaticChain<MonkeyHandler, SquirrelHandler, DogHandler>. The handlers live by
+ * value inside the chain and are asked in order through qualified calls, so
+ * there are no virtual calls, heap handlers or next pointers between them and
+ * the compiler is free to inline the whole dispatch. The chain is still an
+ * AbstractHandler: it can head a runtime chain through SetNext or be the tail
+ * some other handler passes to.
+ */
+template <typename... Handlers>
+class StaticChain : public AbstractHandler {
+ public:
+  bool Claim(std::string_view request, std::string &response) override {
+    return std::apply(
+        [&](Handlers &...handlers) { return (handlers.Handlers::Claim(request, response) || ...); },
+        handlers_);
+  }
+  void ClaimBatch(std::span<const std::string_view> requests, std::span<std::string> responses,
+                  std::vector<std::size_t> &pending) override {
+    std::apply([&](Handlers &...handlers) { (ClaimBatchWith(handlers, requests, responses, pending), ...); },
+               handlers_);
+  }
+
+ private:
+  std::tuple<Handlers...> handlers_;
+};
+/**
+ * Worker threads may dispatch into a ConcurrentChain while other threads add
+ * and remove handlers. Every change publishes a new immutable version of the
+ * handler list with a single atomic store, and readers walk whichever version
+ * is current without taking a lock. An old version, and any handler only it
+ * still owns, is freed once every reader that could have seen it has left.
+ * That grace period is tracked RCU-style with two reader counters per epoch
+ * parity: a writer flips the epoch and waits for the counters of the previous
+ * one to drain. The counters are split into slots on separate cache lines and
+ * each thread sticks to one slot, so dispatching threads do not contend on a
+ * shared counter.
+ *
+ * As with IndexedChain, the handlers added here must not be linked with
+ * SetNext themselves.
+ */
+class ConcurrentChain : public Handler {
+ private:
+  using Version = std::vector<std::shared_ptr<Handler>>;
+
+  /**
+   * Marks the calling thread as a reader of the current epoch for its scope.
+   */
+  class ReadSection {
+   public:
+    explicit ReadSection(ConcurrentChain &chain) {
+      ReaderSlot &slot = chain.slots_[SlotIndex()];
+      for (;;) {
+        const unsigned epoch = chain.epoch_.load();
+        readers_ = &slot.readers[epoch & 1];
+        readers_->fetch_add(1);
+        if (chain.epoch_.load() == epoch) {
+          break;
+        }
+        readers_->fetch_sub(1);
+      }
+    }
+    ~ReadSection() {
+      readers_->fetch_sub(1);
+    }
+
+   private:
+    std::atomic<int> *readers_;
+  };
+
+  static constexpr std::size_t kReaderSlots = 16;
+
+  struct alignas(64) ReaderSlot {
+    std::atomic<int> readers[2] = {0, 0};
+  };
+
+  static std::size_t SlotIndex() {
+    static std::atomic<std::size_t> next_slot(0);
+    thread_local const std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % kReaderSlots;
+    return slot;
+  }
+
+  alignas(64) std::atomic<const Version *> current_;
+  std::atomic<Handler *> next_handler_;
+  std::atomic<unsigned> epoch_;
+  ReaderSlot slots_[kReaderSlots];
+  std::mutex writer_;
+
+  /**
+   * Swaps in a new version and returns once no reader can still be walking the
+   * old one. Must be called with writer_ held.
+   */
+  void Publish(const Version *version) {
+    const Version *old = current_.exchange(version);
+    const unsigned epoch = epoch_.fetch_add(1);
+    // No reader enters the old parity for good once the epoch has moved on, so
+    // the slots can be drained one after another.
+    for (ReaderSlot &slot : slots_) {
+      while (slot.readers[epoch & 1].load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+    delete old;
+  }
+
+ public:
+  ConcurrentChain() : current_(new Version), next_handler_(nullptr), epoch_(0) {
+  }
+  ~ConcurrentChain() {
+    delete current_.load();
+  }
+  /**
+   * The chain's own successor gets the requests none of its handlers took.
+   */
+  Handler *SetNext(Handler *handler) override {
+    next_handler_.store(handler);
+    return handler;
+  }
+  void Insert(std::size_t position, std::shared_ptr<Handler> handler) {
+    std::lock_guard<std::mutex> lock(writer_);
+    Version *version = new Version(*current_.load());
+    position = std::min(position, version->size());
+    version->insert(version->begin() + position, std::move(handler));
+    Publish(version);
+  }
+  void PushBack(std::shared_ptr<Handler> handler) {
+    Insert(static_cast<std::size_t>(-1), std::move(handler));
+  }
+  void Remove(const Handler *handler) {
+    std::lock_guard<std::mutex> lock(writer_);
+    Version *version = new Version(*current_.load());
+    version->erase(std::remove_if(version->begin(), version->end(),
+                                  [handler](const std::shared_ptr<Handler> &h) { return h.get() == handler; }),
+                   version->end());
+    Publish(version);
+  }
+  bool HandleInto(std::string_view request, std::string &response) override {
+    {
+      ReadSection section(*this);
+      for (const std::shared_ptr<Handler> &handler : *current_.load()) {
+        if (handler->HandleInto(request, response)) {
+          return true;
+        }
+      }
+    }
+    Handler *next = next_handler_.load();
+    return next ? next->HandleInto(request, response) : false;
+  }
+  void HandleBatchInto(std::span<const std::string_view> requests, std::span<std::string> responses,
+                       std::vector<std::size_t> &pending) override {
+    {
+      ReadSection section(*this);
+      for (const std::shared_ptr<Handler> &handler : *current_.load()) {
+        if (pending.empty()) {
+          return;
+        }
+        handler->HandleBatchInto(requests, responses, pending);
+      }
+    }
+    Handler *next = next_handler_.load();
+    if (next && !pending.empty()) {
+      next->HandleBatchInto(requests, responses, pending);
     }
   }
 };
@@ -84,16 +433,290 @@ class DogHandler : public AbstractHandler {
  */
 void ClientCode(Handler &handler) {
   std::vector<std::string> food = {"Nut", "Banana", "Cup of coffee"};
+  std::string result;
   for (const std::string &f : food) {
     std::cout << "Client: Who wants a " << f << "?\n";
-    const std::string result = handler.Handle(f);
-    if (!result.empty()) {
+    result.clear();
+    if (handler.HandleInto(f, result)) {
       std::cout << "  " << result;
     } else {
       std::cout << "  " << f << " was left untouched.\n";
     }
   }
 }
+/**
+ * An InstrumentedHandler wraps a handler and records how it is used: how many
+ * requests it took, how many it passed on, and how long its own check took as
+ * a log2 histogram of nanoseconds. The counters are striped over cache lines
+ * and each thread sticks to one stripe, so dispatching threads do not contend
+ * on them. Snapshot() adds the stripes up.
+ */
+class InstrumentedHandler : public AbstractHandler {
+ public:
+  static constexpr std::size_t kLatencyBuckets = 32;
+  /**
+   * latency_ns[b] counts the checks that took [2^b, 2^(b+1)) nanoseconds.
+   */
+  struct Stats {
+    std::uint64_t hits = 0;
+    std::uint64_t passes = 0;
+    std::uint64_t latency_ns[kLatencyBuckets] = {};
+  };
+
+  explicit InstrumentedHandler(AbstractHandler *inner) : inner_(inner) {
+  }
+  std::vector<std::string> Keys() const override {
+    return inner_->Keys();
+  }
+  bool Claim(std::string_view request, std::string &response) override {
+    const auto start = std::chrono::steady_clock::now();
+    const bool handled = inner_->Claim(request, response);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    Stripe &stripe = stripes_[StripeIndex()];
+    (handled ? stripe.hits : stripe.passes).fetch_add(1, std::memory_order_relaxed);
+    const std::size_t bucket = ns == 0 ? 0 : std::min<std::size_t>(std::bit_width(ns) - 1, kLatencyBuckets - 1);
+    stripe.latency_ns[bucket].fetch_add(1, std::memory_order_relaxed);
+    return handled;
+  }
+  Stats Snapshot() const {
+    Stats stats;
+    for (const Stripe &stripe : stripes_) {
+      stats.hits += stripe.hits.load(std::memory_order_relaxed);
+      stats.passes += stripe.passes.load(std::memory_order_relaxed);
+      for (std::size_t b = 0; b < kLatencyBuckets; b++) {
+        stats.latency_ns[b] += stripe.latency_ns[b].load(std::memory_order_relaxed);
+      }
+    }
+    return stats;
+  }
+
+ private:
+  static constexpr std::size_t kStripes = 16;
+
+  struct alignas(64) Stripe {
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> passes{0};
+    std::atomic<std::uint64_t> latency_ns[kLatencyBuckets] = {};
+  };
+
+  static std::size_t StripeIndex() {
+    static std::atomic<std::size_t> next_stripe(0);
+    thread_local const std::size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return stripe;
+  }
+
+  AbstractHandler *inner_;
+  Stripe stripes_[kStripes];
+};
+/**
+ * The adaptive mode instruments every handler it is given and can move the
+ * busiest ones to the front. That is only safe when no request could be taken
+ * by two handlers, so Reorder() keeps the order unless every handler declares
+ * its keys and no key is shared. It must not run while requests are being
+ * dispatched.
+ */
+class AdaptiveChain : public AbstractHandler {
+ private:
+  std::vector<std::unique_ptr<InstrumentedHandler>> handlers_;
+
+ public:
+  AdaptiveChain &Add(AbstractHandler *handler) {
+    handlers_.push_back(std::make_unique<InstrumentedHandler>(handler));
+    return *this;
+  }
+  bool Claim(std::string_view request, std::string &response) override {
+    for (const std::unique_ptr<InstrumentedHandler> &handler : handlers_) {
+      if (handler->Claim(request, response)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  /**
+   * Sorts the handlers by observed hits, most first. Returns false when the
+   * keys do not allow it.
+   */
+  bool Reorder() {
+    std::unordered_set<std::string> seen;
+    for (const std::unique_ptr<InstrumentedHandler> &handler : handlers_) {
+      const std::vector<std::string> keys = handler->Keys();
+      if (keys.empty()) {
+        return false;
+      }
+      for (const std::string &key : keys) {
+        if (!seen.insert(key).second) {
+          return false;
+        }
+      }
+    }
+    std::vector<std::pair<std::uint64_t, std::unique_ptr<InstrumentedHandler>>> ranked;
+    for (std::unique_ptr<InstrumentedHandler> &handler : handlers_) {
+      ranked.emplace_back(handler->Snapshot().hits, std::move(handler));
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (std::size_t i = 0; i < ranked.size(); i++) {
+      handlers_[i] = std::move(ranked[i].second);
+    }
+    return true;
+  }
+  const std::vector<std::unique_ptr<InstrumentedHandler>> &handlers() const {
+    return handlers_;
+  }
+};
+/**
+ * A client with many requests at hand can pass them down the chain together.
+ */
+void BatchClientCode(Handler &handler) {
+  std::vector<std::string_view> food = {"Nut", "Banana", "Cup of coffee", "MeatBall", "Nut"};
+  std::vector<std::string> results(food.size());
+  std::cout << "Client: Who wants this batch of " << food.size() << "?\n";
+  const std::vector<std::size_t> untouched = handler.HandleBatch(food, results);
+  for (std::size_t i = 0; i < food.size(); i++) {
+    if (!results[i].empty()) {
+      std::cout << "  " << results[i];
+    }
+  }
+  for (std::size_t index : untouched) {
+    std::cout << "  " << food[index] << " was left untouched.\n";
+  }
+}
+/**
+ * Readers dispatch into a ConcurrentChain from 1 to 64 threads while a writer
+ * keeps inserting and removing a handler under them. The squirrel stays in the
+ * chain and must take every "Nut"; a "Banana" is either eaten by the monkey or
+ * left untouched, depending on the version a reader saw.
+ */
+void ConcurrentStressClientCode() {
+  for (std::size_t threads = 1; threads <= 64; threads *= 2) {
+    ConcurrentChain chain;
+    chain.PushBack(std::make_shared<SquirrelHandler>());
+    std::shared_ptr<Handler> monkey = std::make_shared<MonkeyHandler>();
+    constexpr int kRounds = 2000;
+    std::atomic<std::size_t> running(threads);
+    std::atomic<std::uint64_t> wrong(0);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> readers;
+    for (std::size_t i = 0; i < threads; i++) {
+      readers.emplace_back([&]() {
+        std::string result;
+        std::uint64_t bad = 0;
+        for (int round = 0; round < kRounds; round++) {
+          result.clear();
+          bad += !chain.HandleInto("Nut", result) || result != "Squirrel: I'll eat the Nut.\n";
+          result.clear();
+          const bool eaten = chain.HandleInto("Banana", result);
+          bad += eaten ? result != "Monkey: I'll eat the Banana.\n" : !result.empty();
+        }
+        wrong.fetch_add(bad);
+        running.fetch_sub(1);
+      });
+    }
+    std::uint64_t swaps = 0;
+    do {
+      chain.Insert(0, monkey);
+      chain.Remove(monkey.get());
+      swaps++;
+    } while (running.load() != 0);
+    for (std::thread &reader : readers) {
+      reader.join();
+    }
+    const auto elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Readers: " << threads << ", " << threads * kRounds * 2000 / std::max<long long>(elapsed_us, 1)
+              << " requests/ms while the monkey came and went " << swaps << " times, " << wrong.load()
+              << " wrong answers.\n";
+  }
+}
+/**
+ * A handler for one numbered key, for building chains of any depth.
+ */
+class NumberedHandler : public ClaimingHandler<NumberedHandler> {
+ public:
+  explicit NumberedHandler(std::size_t number) : key_("Key" + std::to_string(number)) {
+  }
+  std::vector<std::string> Keys() const override {
+    return {key_};
+  }
+  bool Claim(std::string_view request, std::string &response) override {
+    if (request == key_) {
+      response.append("Handler for ").append(key_).append(".\n");
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  std::string key_;
+};
+/**
+ * Sends requests for the last handler of chains 3, 32 and 256 deep, once down
+ * the linked chain and once through an IndexedChain over the same handlers,
+ * and checks that both give the same answers.
+ */
+void DepthClientCode() {
+  constexpr int kRequests = 20000;
+  for (std::size_t depth : {std::size_t(3), std::size_t(32), std::size_t(256)}) {
+    std::vector<std::unique_ptr<NumberedHandler>> handlers;
+    IndexedChain indexed;
+    for (std::size_t i = 0; i < depth; i++) {
+      handlers.push_back(std::make_unique<NumberedHandler>(i));
+      if (i > 0) {
+        handlers[i - 1]->SetNext(handlers[i].get());
+      }
+    }
+    for (const std::unique_ptr<NumberedHandler> &handler : handlers) {
+      indexed.Add(handler.get());
+    }
+    const std::string request = "Key" + std::to_string(depth - 1);
+    std::string linked_response;
+    std::string indexed_response;
+    const auto run = [&](Handler &head, std::string &response) {
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < kRequests; i++) {
+        response.clear();
+        head.HandleInto(request, response);
+      }
+      return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    };
+    const auto linked_us = run(*handlers.front(), linked_response);
+    // handlers in an IndexedChain must not be linked themselves
+    for (const std::unique_ptr<NumberedHandler> &handler : handlers) {
+      handler->SetNext(nullptr);
+    }
+    const auto indexed_us = run(indexed, indexed_response);
+    std::cout << "Depth " << depth << ": " << kRequests << " requests for the last handler took " << linked_us
+              << " us down the linked chain, " << indexed_us << " us indexed; the answers "
+              << (linked_response == indexed_response ? "match" : "differ") << ".\n";
+  }
+}
+/**
+ * Counts heap allocations, so main can check that a hop down the chain costs
+ * none once the response buffer is large enough. The two functions that touch
+ * malloc and free are kept out of line so GCC does not pair them up with the
+ * replaced operators and warn about a mismatch.
+ */
+std::atomic<std::size_t> allocations(0);
+[[gnu::noinline]] void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+void *operator new(std::size_t size) {
+  if (void *memory = operator new(size, std::nothrow)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void *memory) noexcept {
+  std::free(memory);
+}
+void operator delete(void *memory, std::size_t) noexcept {
+  operator delete(memory);
+}
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+  operator delete(memory);
+}
 /**
  * The other part of the client code constructs the actual chain.
  */
@@ -112,6 +735,91 @@ int main() {
   std::cout << "\n";
   std::cout << "Subchain: Squirrel > Dog\n\n";
   ClientCode(*squirrel);
+  std::cout << "\n";
+  std::cout << "Batch: Monkey > Squirrel > Dog\n\n";
+  BatchClientCode(*monkey);
+
+  std::string response;
+  response.reserve(64);
+  const std::size_t allocations_before = allocations.load();
+  for (int i = 0; i < 1000; i++) {
+    response.clear();
+    monkey->HandleInto("MeatBall", response);
+    response.clear();
+    monkey->HandleInto("Cup of coffee", response);
+  }
+  std::cout << "\nHeap allocations for 2000 requests down the chain: " << allocations.load() - allocations_before
+            << "\n\n";
+  DepthClientCode();
+
+  MonkeyHandler indexed_monkey;
+  SquirrelHandler indexed_squirrel;
+  DogHandler indexed_dog;
+  IndexedChain indexed;
+  indexed.Add(&indexed_monkey).Add(&indexed_squirrel).Add(&indexed_dog);
+  std::cout << "\n";
+  std::cout << "Indexed chain: Monkey > Squirrel > Dog\n\n";
+  ClientCode(indexed);
+  BatchClientCode(indexed);
+
+  MonkeyHandler adaptive_monkey;
+  SquirrelHandler adaptive_squirrel;
+  DogHandler adaptive_dog;
+  AdaptiveChain adaptive;
+  adaptive.Add(&adaptive_monkey).Add(&adaptive_squirrel).Add(&adaptive_dog);
+  std::cout << "\n";
+  std::cout << "Adaptive chain: Monkey > Squirrel > Dog\n\n";
+  ClientCode(adaptive);
+  BatchClientCode(adaptive);
+  adaptive.Reorder();
+  std::cout << "After reordering by hits:";
+  for (const std::unique_ptr<InstrumentedHandler> &handler : adaptive.handlers()) {
+    const InstrumentedHandler::Stats stats = handler->Snapshot();
+    std::cout << " " << handler->Keys().front() << " (" << stats.hits << " hits, " << stats.passes << " passes)";
+  }
+  std::cout << "\n";
+
+  StaticChain<MonkeyHandler, SquirrelHandler> static_chain;
+  DogHandler static_tail;
+  static_chain.SetNext(&static_tail);
+  std::cout << "\n";
+  std::cout << "Static chain: Monkey > Squirrel, then runtime Dog\n\n";
+  ClientCode(static_chain);
+  BatchClientCode(static_chain);
+
+  /**
+   * Dispatching threads keep running while the chain is rebuilt under them.
+   */
+  ConcurrentChain concurrent;
+  concurrent.PushBack(std::make_shared<SquirrelHandler>());
+  concurrent.PushBack(std::make_shared<DogHandler>());
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 4; i++) {
+    workers.emplace_back([&concurrent, &stop]() {
+      std::string result;
+      while (!stop.load()) {
+        result.clear();
+        concurrent.HandleInto("Banana", result);
+      }
+    });
+  }
+  std::shared_ptr<Handler> concurrent_monkey = std::make_shared<MonkeyHandler>();
+  for (int i = 0; i < 100; i++) {
+    concurrent.Insert(0, concurrent_monkey);
+    concurrent.Remove(concurrent_monkey.get());
+  }
+  concurrent.Insert(0, concurrent_monkey);
+  stop.store(true);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  std::cout << "\n";
+  std::cout << "Concurrent chain: Monkey > Squirrel > Dog\n\n";
+  ClientCode(concurrent);
+  BatchClientCode(concurrent);
+  std::cout << "\n";
+  ConcurrentStressClientCode();
 
   delete monkey;
   delete squirrel;
@@ -3,8 +3,27 @@
   all information about the request. This transformation lets you pass requests as a method arguments,
   delay or queue a request’s execution, and support undoable operations.
 */
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
 const int MaxCommand = 5;
@@ -15,10 +34,14 @@ enum Receiver
 }; 
 
 // Command Interface
+// undo() reverts what execute() did; commands with nothing to revert keep the
+// default.
 class Command
 {
 public:
+	virtual ~Command() {}
 	virtual void execute() = 0;
+	virtual void undo() {}
 };
  
 // Receiver Class
@@ -56,10 +79,14 @@ public:
 class LightOnCommand : public Command 
 {
 public:
+	static const bool Idempotent = true;
     LightOnCommand(Light *light) : mLight(light) {}
 	void execute(){
 		mLight->on();
 	}
+	void undo(){
+		mLight->off();
+	}
 private:
 	Light *mLight;
 };
@@ -68,10 +95,14 @@ private:
 class LightOffCommand : public Command 
 {
 public:
+	static const bool Idempotent = true;
         LightOffCommand(Light *light) : mLight(light) {}
 	void execute(){
 		mLight->off();
 	}
+	void undo(){
+		mLight->on();
+	}
 private:
 	Light *mLight;
 };
@@ -80,10 +111,14 @@ private:
 class FanOnCommand : public Command 
 {
 public:
+	static const bool Idempotent = true;
         FanOnCommand(Fan *fan) : mFan(fan) {}
 	void execute(){
 		mFan->on();
 	}
+	void undo(){
+		mFan->off();
+	}
 private:
 	Fan *mFan;
 };
@@ -92,43 +127,767 @@ private:
 class FanOffCommand : public Command 
 {
 public:
+	static const bool Idempotent = true;
         FanOffCommand(Fan *fan) : mFan(fan) {}
 	void execute(){
 		mFan->off();
 	}
+	void undo(){
+		mFan->on();
+	}
 private:
 	Fan *mFan;
 };
 
+// Value-type command
+// Holds any command object by value in a small inline buffer, so creating,
+// copying and storing a command never touches the heap. The stored command is
+// called directly rather than through Command's vtable. Anything with an
+// execute() member fits as long as it is no larger than the buffer; a plain
+// Command* is kept as a non-owning reference. A stored type declares
+// "static const bool Idempotent = true" when it puts its receiver into a fixed
+// state, so running it again, or instead of an earlier press, changes nothing.
+class InlineCommand
+{
+public:
+	static const size_t Capacity = 3 * sizeof(void*);
+
+	InlineCommand() : InlineCommand(NullCommand()) {}
+
+	InlineCommand(Command *cmd) : InlineCommand(CommandRef{cmd}) {}
+
+	template <typename T, typename Stored = decay_t<T>,
+	          typename = enable_if_t<!is_same_v<Stored, InlineCommand> && !is_pointer_v<Stored>>>
+	InlineCommand(T &&cmd) : mOps(&opsFor<Stored>) {
+		static_assert(sizeof(Stored) <= Capacity, "command does not fit the inline buffer");
+		static_assert(alignof(Stored) <= alignof(max_align_t), "command is over-aligned");
+		new (mStorage) Stored(std::forward<T>(cmd));
+	}
+
+	InlineCommand(const InlineCommand &other) : mOps(other.mOps) {
+		mOps->copy(mStorage, other.mStorage);
+	}
+
+	InlineCommand(InlineCommand &&other) : mOps(other.mOps) {
+		mOps->move(mStorage, other.mStorage);
+	}
+
+	InlineCommand &operator=(const InlineCommand &other) {
+		if(this != &other) {
+			mOps->destroy(mStorage);
+			mOps = other.mOps;
+			mOps->copy(mStorage, other.mStorage);
+		}
+		return *this;
+	}
+
+	InlineCommand &operator=(InlineCommand &&other) {
+		if(this != &other) {
+			mOps->destroy(mStorage);
+			mOps = other.mOps;
+			mOps->move(mStorage, other.mStorage);
+		}
+		return *this;
+	}
+
+	~InlineCommand() {
+		mOps->destroy(mStorage);
+	}
+
+	void execute() {
+		mOps->execute(mStorage);
+	}
+
+	// Does nothing for stored objects that have no undo() member.
+	void undo() {
+		mOps->undo(mStorage);
+	}
+
+	bool idempotent() const {
+		return mOps->idempotent;
+	}
+
+private:
+	struct CommandRef {
+		Command *cmd;
+		void execute() { cmd->execute(); }
+		void undo() { cmd->undo(); }
+	};
+
+	struct Ops {
+		void (*execute)(void *self);
+		void (*undo)(void *self);
+		void (*copy)(void *self, const void *other);
+		void (*move)(void *self, void *other);
+		void (*destroy)(void *self);
+		bool idempotent;
+	};
+
+	template <typename T>
+	static constexpr bool isIdempotent() {
+		if constexpr(requires { T::Idempotent; })
+			return T::Idempotent;
+		else
+			return false;
+	}
+
+	template <typename T>
+	static constexpr Ops opsFor = {
+		[](void *self) { static_cast<T*>(self)->T::execute(); },
+		[](void *self) {
+			if constexpr(requires(T &cmd) { cmd.undo(); })
+				static_cast<T*>(self)->T::undo();
+		},
+		[](void *self, const void *other) { new (self) T(*static_cast<const T*>(other)); },
+		[](void *self, void *other) { new (self) T(std::move(*static_cast<T*>(other))); },
+		[](void *self) { static_cast<T*>(self)->~T(); },
+		isIdempotent<T>(),
+	};
+
+	alignas(max_align_t) unsigned char mStorage[Capacity];
+	const Ops *mOps;
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's
+// design). Each cell carries a sequence number telling producers and consumers
+// whether it is free or full, so neither side takes a lock. The capacity is
+// rounded up to a power of two.
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : mCells(roundUp(capacity)), mMask(mCells.size() - 1), mHead(0), mTail(0) {
+		for(size_t i = 0; i < mCells.size(); i++)
+			mCells[i].sequence.store(i, memory_order_relaxed);
+	}
+
+	// Returns false when the queue is full.
+	bool tryPush(const T &value) {
+		size_t pos = mTail.load(memory_order_relaxed);
+		for(;;) {
+			Cell &cell = mCells[pos & mMask];
+			intptr_t diff = (intptr_t)cell.sequence.load(memory_order_acquire) - (intptr_t)pos;
+			if(diff == 0) {
+				if(mTail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(pos + 1, memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;
+			} else {
+				pos = mTail.load(memory_order_relaxed);
+			}
+		}
+	}
+
+	// Returns false when the queue is empty.
+	bool tryPop(T &value) {
+		size_t pos = mHead.load(memory_order_relaxed);
+		for(;;) {
+			Cell &cell = mCells[pos & mMask];
+			intptr_t diff = (intptr_t)cell.sequence.load(memory_order_acquire) - (intptr_t)(pos + 1);
+			if(diff == 0) {
+				if(mHead.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					value = std::move(cell.value);
+					cell.sequence.store(pos + mMask + 1, memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;
+			} else {
+				pos = mHead.load(memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Cell {
+		atomic<size_t> sequence;
+		T value;
+	};
+
+	static size_t roundUp(size_t capacity) {
+		size_t size = 2;
+		while(size < capacity)
+			size <<= 1;
+		return size;
+	}
+
+	vector<Cell> mCells;
+	const size_t mMask;
+	alignas(64) atomic<size_t> mHead;
+	alignas(64) atomic<size_t> mTail;
+};
+
+// Executor
+// Runs commands on a pool of worker threads. Every worker drains its own queue
+// and a receiver is always routed to the same queue, so the commands of one
+// receiver run in the order they were submitted while different receivers run
+// in parallel. A full queue pushes back on the caller: trySubmit fails and
+// submit waits for room. A worker with nothing queued sleeps on its queue's
+// pending counter until a submit wakes it.
+class CommandExecutor
+{
+public:
+	explicit CommandExecutor(size_t workers = thread::hardware_concurrency(), size_t capacity = 1024) : mStopping(false) {
+		if(workers == 0)
+			workers = 1;
+		for(size_t i = 0; i < workers; i++)
+			mLanes.push_back(make_unique<Lane>(capacity));
+		for(size_t i = 0; i < workers; i++)
+			mWorkers.emplace_back(&CommandExecutor::run, this, i);
+	}
+	~CommandExecutor() {
+		shutdown();
+	}
+
+	// With undo set, the worker calls cmd.undo() instead of cmd.execute().
+	// Returns false when the queue is full or the executor has been shut down.
+	bool trySubmit(size_t receiver, const InlineCommand &cmd, bool undo = false) {
+		if(mStopping.load(memory_order_acquire))
+			return false;
+		Lane &lane = *mLanes[receiver % mLanes.size()];
+		// counted before the push, so a worker never takes the counter below zero
+		if(lane.pending.fetch_add(1, memory_order_relaxed) == 0)
+			lane.pending.notify_one();
+		if(!lane.queue.tryPush(Task{cmd, undo})) {
+			lane.pending.fetch_sub(1, memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	// Throws runtime_error once the executor has been shut down.
+	void submit(size_t receiver, const InlineCommand &cmd, bool undo = false) {
+		while(!trySubmit(receiver, cmd, undo)) {
+			if(mStopping.load(memory_order_acquire))
+				throw runtime_error("submit to a stopped CommandExecutor");
+			this_thread::yield();
+		}
+	}
+
+	// Runs everything already submitted, then stops the workers. Producers
+	// must be done submitting before this is called.
+	void shutdown() {
+		mStopping.store(true, memory_order_release);
+		for(unique_ptr<Lane> &lane : mLanes) {
+			lane->pending.fetch_add(1, memory_order_release);
+			lane->pending.notify_one();
+		}
+		for(thread &worker : mWorkers)
+			if(worker.joinable())
+				worker.join();
+	}
+
+private:
+	void run(size_t index) {
+		Lane &lane = *mLanes[index];
+		Task task;
+		for(;;) {
+			if(lane.queue.tryPop(task)) {
+				task.undo ? task.cmd.undo() : task.cmd.execute();
+				lane.pending.fetch_sub(1, memory_order_relaxed);
+			} else if(mStopping.load(memory_order_acquire)) {
+				break;
+			} else if(lane.pending.load(memory_order_acquire) == 0) {
+				lane.pending.wait(0, memory_order_acquire);
+			} else {
+				// a submit is between its count and its push
+				this_thread::yield();
+			}
+		}
+	}
+
+	struct Task {
+		InlineCommand cmd;
+		bool undo = false;
+	};
+
+	struct Lane {
+		explicit Lane(size_t capacity) : queue(capacity), pending(0) {}
+		BoundedQueue<Task> queue;
+		alignas(64) atomic<size_t> pending;
+	};
+
+	vector<unique_ptr<Lane>> mLanes;
+	vector<thread> mWorkers;
+	atomic<bool> mStopping;
+};
+
+// Command journal
+// An append-only binary log of the button presses a RemoteControl carried out,
+// two bytes per press. Presses are buffered and committed in groups: a group is
+// written and fdatasync'd once it is full or when commit() is called, so the
+// cost of durability is paid per group rather than per press. The journal also
+// tracks the on/off state every press leads to and, every snapshotEvery
+// presses, saves it next to the log together with the number of records it
+// covers. recover() loads that snapshot and replays only the records after it
+// from a memory-mapped log, so recovery never runs the receivers and its cost
+// stays bounded.
+class CommandJournal
+{
+public:
+	CommandJournal(const string &path, size_t groupSize = 4096, size_t snapshotEvery = 1 << 20)
+		: mPath(path), mGroupSize(groupSize), mSnapshotEvery(snapshotEvery), mSinceSnapshot(0) {
+		mState = recover(path, &mRecords);
+		mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(mFd < 0)
+			throw runtime_error("cannot open journal " + path);
+		// drop a torn record left by a crash in the middle of a write
+		if(ftruncate(mFd, mRecords * sizeof(Record)) != 0)
+			throw runtime_error("cannot truncate journal " + path);
+	}
+
+	// Commits what is still pending. A failure cannot be reported from here,
+	// so callers that care call commit() themselves first.
+	~CommandJournal() {
+		try {
+			commit();
+		} catch(const exception &) {
+		}
+		close(mFd);
+	}
+
+	void append(Receiver id, bool on) {
+		mPending.push_back(Record{(uint8_t)id, (uint8_t)on});
+		mState[id] = on;
+		if(mPending.size() >= mGroupSize)
+			commit();
+	}
+
+	// Throws runtime_error when the group cannot be written or synced; the
+	// presses are then not durable.
+	void commit() {
+		if(mPending.empty())
+			return;
+		const char *data = (const char*)mPending.data();
+		size_t left = mPending.size() * sizeof(Record);
+		while(left > 0) {
+			ssize_t written = write(mFd, data, left);
+			if(written < 0)
+				throw runtime_error("cannot write journal " + mPath);
+			data += written;
+			left -= written;
+		}
+		const size_t group = mPending.size();
+		mRecords += group;
+		mPending.clear();
+		if(fdatasync(mFd) != 0)
+			throw runtime_error("cannot sync journal " + mPath);
+		mSinceSnapshot += group;
+		if(mSinceSnapshot >= mSnapshotEvery)
+			snapshot();
+	}
+
+	// Saves the state reached by everything committed so far. The snapshot is
+	// written to a temporary file and renamed, so a crash keeps the old one.
+	void snapshot() {
+		commit();
+		const string tmp = mPath + ".snap.tmp";
+		FILE *file = fopen(tmp.c_str(), "wb");
+		if(!file)
+			throw runtime_error("cannot write snapshot " + tmp);
+		bool ok = fwrite(&mRecords, sizeof(mRecords), 1, file) == 1
+			&& fwrite(mState.data(), 1, mState.size(), file) == mState.size()
+			&& fflush(file) == 0
+			&& fsync(fileno(file)) == 0;
+		ok = fclose(file) == 0 && ok;
+		if(!ok || rename(tmp.c_str(), (mPath + ".snap").c_str()) != 0) {
+			remove(tmp.c_str());
+			throw runtime_error("cannot write snapshot " + tmp);
+		}
+		mSinceSnapshot = 0;
+	}
+
+	// The on/off state of every receiver after the last press.
+	const vector<uint8_t> &state() const {
+		return mState;
+	}
+
+	// Rebuilds the receiver state from the snapshot and the log at path.
+	// Optionally reports how many whole records the log holds. A snapshot that
+	// claims more records than the log holds belongs to another log and is
+	// ignored.
+	static vector<uint8_t> recover(const string &path, uint64_t *records = nullptr) {
+		uint64_t count = 0;
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if(fd >= 0 && fstat(fd, &st) == 0)
+			count = st.st_size / sizeof(Record);
+		vector<uint8_t> state(MaxCommand, 0);
+		uint64_t from = 0;
+		if(FILE *file = fopen((path + ".snap").c_str(), "rb")) {
+			if(fread(&from, sizeof(from), 1, file) != 1 || fread(state.data(), 1, state.size(), file) != state.size()
+				|| from > count) {
+				from = 0;
+				fill(state.begin(), state.end(), 0);
+			}
+			fclose(file);
+		}
+		if(fd >= 0) {
+			if(count > from) {
+				void *map = mmap(nullptr, count * sizeof(Record), PROT_READ, MAP_PRIVATE, fd, 0);
+				if(map != MAP_FAILED) {
+					madvise(map, count * sizeof(Record), MADV_SEQUENTIAL);
+					const Record *log = (const Record*)map;
+					for(uint64_t i = from; i < count; i++)
+						if(log[i].receiver < state.size())
+							state[log[i].receiver] = log[i].on;
+					munmap(map, count * sizeof(Record));
+				}
+			}
+			close(fd);
+		}
+		if(records)
+			*records = count;
+		return state;
+	}
+
+private:
+	struct Record {
+		uint8_t receiver;
+		uint8_t on;
+	};
+
+	string mPath;
+	int mFd;
+	size_t mGroupSize, mSnapshotEvery, mSinceSnapshot;
+	uint64_t mRecords;
+	vector<Record> mPending;
+	vector<uint8_t> mState;
+};
+
 // Invoker 
 // Stores the ConcreteCommand object 
 class RemoteControl 
 {
 public:
-	RemoteControl() : mOnCommand(MaxCommand), mOffCommand(MaxCommand) {
-		Command *nullCmd = new NullCommand;
-		for(int i = 0; i < MaxCommand; i++) {
-			mOffCommand[i] = nullCmd;
-			mOnCommand[i] = nullCmd;
-		}
-	}
-	void setCommand(Receiver id, Command *onCmd, Command *offCmd) {
+	// How many presses undo can walk back.
+	static const size_t MaxHistory = 1024;
+
+	// Counters of the batching mode.
+	struct BatchStats {
+		uint64_t queued = 0;
+		uint64_t executed = 0;
+		uint64_t elided = 0;
+	};
+
+	// Every slot starts out holding a NullCommand by value.
+	RemoteControl()
+		: mOnCommand(MaxCommand), mOffCommand(MaxCommand), mExecutor(nullptr), mJournal(nullptr),
+		  mHistory(MaxHistory), mHistoryStart(0), mHistoryCount(0), mApplied(0), mBatchWindow(0), mQueuedInWindow(0), mQueued(MaxCommand, -1), mLastRun(MaxCommand, -1) {}
+
+	void setCommand(Receiver id, InlineCommand onCmd, InlineCommand offCmd) {
+		flushBatch();
 		mOnCommand[id] = onCmd;
 		mOffCommand[id] = offCmd;
+		// whatever the old commands did says nothing about the new receiver
+		mLastRun[id] = -1;
+	}
+
+	// With an executor set, button presses are queued and run asynchronously
+	// instead of on the caller's thread.
+	void setExecutor(CommandExecutor *executor) {
+		mExecutor = executor;
+	}
+
+	// With a journal set, every press, undo and redo is logged.
+	void setJournal(CommandJournal *journal) {
+		mJournal = journal;
+	}
+
+	// Batching mode
+	// While batching, presses on slots whose on and off commands are both
+	// idempotent are queued instead of run; presses on any other slot run
+	// right away. A press replaces the press already queued for its slot,
+	// since such a command leaves its receiver in the same state however often
+	// it is repeated. A press that only repeats what the slot last ran is
+	// dropped as well, so an on/off/on/off burst on a light this remote already
+	// turned off costs nothing; that assumes nothing but this remote drives the
+	// receiver. The survivors run together once window presses have been
+	// queued or when flushBatch() is called. A window of 0 turns batching off.
+	void setBatching(size_t window) {
+		mBatchWindow = window;
+		if(window == 0)
+			flushBatch();
+	}
+
+	void flushBatch() {
+		for(Receiver id : mQueuedOrder) {
+			bool on = mQueued[id] == 1;
+			mQueued[id] = -1;
+			if(mLastRun[id] == (int8_t)on) {
+				mBatchStats.elided++;
+				continue;
+			}
+			mBatchStats.executed++;
+			apply(id, on);
+		}
+		mQueuedOrder.clear();
+		mQueuedInWindow = 0;
+	}
+
+	const BatchStats &batchStats() const {
+		return mBatchStats;
 	}
 
 	void onButtonPressed(Receiver id) {
-		mOnCommand[id]->execute();
+		press(id, true);
 	} 
 
 	void offButtonPressed(Receiver id) {
-		mOffCommand[id]->execute();
+		press(id, false);
 	} 
 
+	// Reverts the most recent press that has not been undone yet by running
+	// the slot's command for the state the receiver was in before it. When
+	// this remote had not driven the receiver before that press, there is no
+	// state to go back to and nothing runs.
+	void undoButtonPressed() {
+		flushBatch();
+		if(mApplied == 0)
+			return;
+		Press &last = historyAt(--mApplied);
+		if(last.before != -1)
+			run(last.id, last.before == 1, last.restore);
+	}
+
+	// Carries out again the most recently undone press.
+	void redoButtonPressed() {
+		flushBatch();
+		if(mApplied == mHistoryCount)
+			return;
+		Press &next = historyAt(mApplied++);
+		run(next.id, next.on, next.cmd);
+	}
+
 private:
-	vector<Command*> mOnCommand, mOffCommand;
+	// restore is the command that brings the receiver back to before, the
+	// state it was in ahead of the press (-1 when unknown).
+	struct Press {
+		Receiver id;
+		bool on;
+		int8_t before;
+		InlineCommand cmd;
+		InlineCommand restore;
+	};
+
+	void press(Receiver id, bool on) {
+		if(mBatchWindow == 0 || !mOnCommand[id].idempotent() || !mOffCommand[id].idempotent()) {
+			apply(id, on);
+			return;
+		}
+		mBatchStats.queued++;
+		if(mQueued[id] == -1)
+			mQueuedOrder.push_back(id);
+		else
+			mBatchStats.elided++;
+		mQueued[id] = on;
+		if(++mQueuedInWindow >= mBatchWindow)
+			flushBatch();
+	}
+
+	void apply(Receiver id, bool on) {
+		InlineCommand &cmd = on ? mOnCommand[id] : mOffCommand[id];
+		const int8_t before = mLastRun[id];
+		// a new press drops what was undone; a full history forgets its oldest
+		mHistoryCount = mApplied;
+		if(mHistoryCount == MaxHistory) {
+			mHistoryStart = (mHistoryStart + 1) % MaxHistory;
+			mHistoryCount--;
+		}
+		historyAt(mHistoryCount) = Press{id, on, before, cmd, before == 1 ? mOnCommand[id] : mOffCommand[id]};
+		mApplied = ++mHistoryCount;
+		run(id, on, cmd);
+	}
+
+	void run(Receiver id, bool on, InlineCommand &cmd) {
+		mLastRun[id] = on;
+		if(mJournal)
+			mJournal->append(id, on);
+		if(mExecutor)
+			mExecutor->submit(id, cmd);
+		else
+			cmd.execute();
+	}
+
+	// The i-th oldest press in the history ring.
+	Press &historyAt(size_t i) {
+		return mHistory[(mHistoryStart + i) % MaxHistory];
+	}
+
+	vector<InlineCommand> mOnCommand, mOffCommand;
+	CommandExecutor *mExecutor;
+	CommandJournal *mJournal;
+	// a ring of MaxHistory presses, allocated once, so pressing never allocates
+	vector<Press> mHistory;
+	size_t mHistoryStart, mHistoryCount, mApplied;
+	size_t mBatchWindow, mQueuedInWindow;
+	// per slot: -1 for nothing queued / never run, otherwise 1 for on, 0 for off
+	vector<int8_t> mQueued, mLastRun;
+	vector<Receiver> mQueuedOrder;
+	BatchStats mBatchStats;
 };
  
+// Invoker for large installations
+// Devices register under an arbitrary id and get a dense slot; the on and off
+// commands of all slots live by value in two contiguous arrays, so there is
+// no fixed limit like MaxCommand. Commands come from a closed set of known
+// types and a press is dispatched with std::visit, which compiles to a jump
+// table, instead of a virtual call.
+//
+// Removing a device moves the last slot into the freed one, so callers never
+// see slots. They hold a DeviceHandle instead, which goes through a small
+// indirection table that follows the move, and whose generation makes a
+// handle to a removed device fail rather than press whoever took its place.
+class DeviceRemoteControl
+{
+public:
+	using DeviceCommand = variant<NullCommand, LightOnCommand, LightOffCommand, FanOnCommand, FanOffCommand>;
+
+	struct DeviceHandle {
+		uint32_t index;
+		uint32_t generation;
+	};
+
+	// Registers the device, or replaces its commands, and returns its handle.
+	DeviceHandle registerDevice(uint64_t deviceId, const DeviceCommand &onCmd, const DeviceCommand &offCmd) {
+		auto found = mIndex.find(deviceId);
+		if(found != mIndex.end()) {
+			size_t slot = mEntries[found->second].slot;
+			mOnCommand[slot] = onCmd;
+			mOffCommand[slot] = offCmd;
+			return DeviceHandle{found->second, mEntries[found->second].generation};
+		}
+		uint32_t index;
+		if(mFree.empty()) {
+			index = (uint32_t)mEntries.size();
+			mEntries.push_back(Entry{0, 0});
+		} else {
+			index = mFree.back();
+			mFree.pop_back();
+		}
+		mEntries[index].slot = (uint32_t)mOnCommand.size();
+		mOnCommand.push_back(onCmd);
+		mOffCommand.push_back(offCmd);
+		mOwner.push_back(index);
+		mIndex.emplace(deviceId, index);
+		return DeviceHandle{index, mEntries[index].generation};
+	}
+
+	// Removes the device; handles to it go stale, handles to the others stay
+	// valid.
+	void unregisterDevice(uint64_t deviceId) {
+		auto found = mIndex.find(deviceId);
+		if(found == mIndex.end())
+			return;
+		Entry &entry = mEntries[found->second];
+		size_t slot = entry.slot;
+		mIndex.erase(found);
+		if(slot != mOnCommand.size() - 1) {
+			mOnCommand[slot] = std::move(mOnCommand.back());
+			mOffCommand[slot] = std::move(mOffCommand.back());
+			mOwner[slot] = mOwner.back();
+			mEntries[mOwner[slot]].slot = (uint32_t)slot;
+		}
+		mOnCommand.pop_back();
+		mOffCommand.pop_back();
+		mOwner.pop_back();
+		entry.generation++;
+		mFree.push_back((uint32_t)(&entry - mEntries.data()));
+	}
+
+	// Throws out_of_range for an unknown device.
+	DeviceHandle handleOf(uint64_t deviceId) const {
+		uint32_t index = mIndex.at(deviceId);
+		return DeviceHandle{index, mEntries[index].generation};
+	}
+
+	size_t size() const {
+		return mOnCommand.size();
+	}
+
+	// Both throw out_of_range for a handle whose device has been removed.
+	void onButtonPressed(DeviceHandle device) {
+		dispatch(mOnCommand[slotOf(device)]);
+	}
+
+	void offButtonPressed(DeviceHandle device) {
+		dispatch(mOffCommand[slotOf(device)]);
+	}
+
+	void onButtonPressed(uint64_t deviceId) {
+		onButtonPressed(handleOf(deviceId));
+	}
+
+	void offButtonPressed(uint64_t deviceId) {
+		offButtonPressed(handleOf(deviceId));
+	}
+
+private:
+	struct Entry {
+		uint32_t slot;
+		uint32_t generation;
+	};
+
+	size_t slotOf(DeviceHandle device) const {
+		if(device.index >= mEntries.size() || mEntries[device.index].generation != device.generation)
+			throw out_of_range("stale device handle");
+		return mEntries[device.index].slot;
+	}
+
+	static void dispatch(DeviceCommand &cmd) {
+		visit([](auto &concrete) {
+			using T = decay_t<decltype(concrete)>;
+			concrete.T::execute();
+		}, cmd);
+	}
+
+	unordered_map<uint64_t, uint32_t> mIndex;
+	vector<Entry> mEntries;
+	vector<uint32_t> mFree;
+	vector<DeviceCommand> mOnCommand, mOffCommand;
+	// per slot: the entry that points at it
+	vector<uint32_t> mOwner;
+};
+
+// Counts heap allocations, so main can check that storing, copying and
+// running commands costs none. The two functions that touch malloc and free
+// are kept out of line so GCC does not pair them up with the replaced
+// operators and warn about a mismatch.
+atomic<size_t> allocations(0);
+[[gnu::noinline]] void *operator new(size_t size, const nothrow_t &) noexcept {
+	allocations.fetch_add(1, memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+void *operator new(size_t size) {
+	if(void *memory = operator new(size, nothrow))
+		return memory;
+	throw bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void *memory) noexcept {
+	free(memory);
+}
+void operator delete(void *memory, size_t) noexcept {
+	operator delete(memory);
+}
+void operator delete(void *memory, const nothrow_t &) noexcept {
+	operator delete(memory);
+}
+
+// A command that only counts how often it ran, so a long run prints nothing.
+class TallyCommand
+{
+public:
+	TallyCommand(uint64_t *count) : mCount(count) {}
+	void execute() {
+		++*mCount;
+	}
+private:
+	uint64_t *mCount;
+};
+
 // The client
 int main() 
 {
@@ -136,13 +895,13 @@ int main()
 	Light *light = new Light;
 	Fan *fan = new Fan;
 
-	// concrete Command objects 
-	LightOnCommand *lightOn = new LightOnCommand(light);
-	LightOffCommand *lightOff = new LightOffCommand(light);
-	FanOnCommand *fanOn = new FanOnCommand(fan);
-	FanOffCommand *fanOff = new FanOffCommand(fan);
-	NullCommand *nullOn = new NullCommand();
-	NullCommand *nullOff = new NullCommand();
+	// concrete Command objects, stored by value in the remote's slots
+	LightOnCommand lightOn(light);
+	LightOffCommand lightOff(light);
+	FanOnCommand fanOn(fan);
+	FanOffCommand fanOff(fan);
+	NullCommand nullOn;
+	NullCommand nullOff;
 
 	// invoker objects
 	RemoteControl *control = new RemoteControl;
@@ -159,8 +918,77 @@ int main()
 	control->setCommand(NONE, nullOn, nullOff);
 	control->onButtonPressed(NONE);
 
-	delete light, lightOn, lightOff;
-	delete fan, fanOn, fanOff;
+	// execute asynchronously: the light and the fan each keep their order
+	CommandExecutor executor(2);
+	control->setExecutor(&executor);
+	control->onButtonPressed(LIGHT);
+	control->onButtonPressed(FAN);
+	control->offButtonPressed(LIGHT);
+	control->offButtonPressed(FAN);
+	executor.shutdown();
+	control->setExecutor(nullptr);
+
+	// undo and redo, recorded in a journal that rebuilds the state on restart
+	{
+		CommandJournal journal("remote.journal");
+		control->setJournal(&journal);
+		control->onButtonPressed(LIGHT);
+		control->onButtonPressed(FAN);
+		control->undoButtonPressed();
+		control->undoButtonPressed();
+		control->redoButtonPressed();
+		journal.snapshot();
+		control->offButtonPressed(FAN);
+		control->setJournal(nullptr);
+	}
+	vector<uint8_t> recovered = CommandJournal::recover("remote.journal");
+	cout << "Recovered from journal: the light is " << (recovered[LIGHT] ? "on" : "off")
+	     << ", the fan is " << (recovered[FAN] ? "on" : "off") << "\n";
+	remove("remote.journal");
+	remove("remote.journal.snap");
+
+	// a bursty client, coalesced per slot
+	control->setBatching(16);
+	control->onButtonPressed(LIGHT);
+	control->offButtonPressed(LIGHT);
+	control->onButtonPressed(LIGHT);
+	control->offButtonPressed(LIGHT);
+	control->onButtonPressed(FAN);
+	control->onButtonPressed(FAN);
+	control->flushBatch();
+	control->setBatching(0);
+	const RemoteControl::BatchStats &stats = control->batchStats();
+	cout << "Batched " << stats.queued << " presses: " << stats.executed << " executed, "
+	     << stats.elided << " elided\n";
+
+	// a remote for any number of devices, registered by id
+	DeviceRemoteControl devices;
+	DeviceRemoteControl::DeviceHandle hallLight = devices.registerDevice(1001, LightOnCommand(light), LightOffCommand(light));
+	devices.registerDevice(2002, FanOnCommand(fan), FanOffCommand(fan));
+	devices.onButtonPressed(hallLight);
+	devices.offButtonPressed(2002);
+
+	// a million commands created, copied, stored and run, and a million presses
+	uint64_t tally = 0;
+	size_t allocationsBefore = allocations.load();
+	InlineCommand stored;
+	for(int i = 0; i < 1000000; i++) {
+		InlineCommand cmd = TallyCommand(&tally);
+		stored = cmd;
+		stored.execute();
+	}
+	size_t commandAllocations = allocations.load() - allocationsBefore;
+	control->setCommand(DOOR, TallyCommand(&tally), TallyCommand(&tally));
+	allocationsBefore = allocations.load();
+	for(int i = 0; i < 500000; i++) {
+		control->onButtonPressed(DOOR);
+		control->offButtonPressed(DOOR);
+	}
+	cout << "Heap allocations for " << tally << " commands run: " << commandAllocations
+	     << " to create and store them, " << allocations.load() - allocationsBefore << " for the presses\n";
+
+	delete light;
+	delete fan;
 	delete control;
 
 	return 0;
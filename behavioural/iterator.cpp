@@ -13,25 +13,115 @@ Thanks to the Iterator, clients can go over elements of different collections in
  * underlying representation (list, stack, tree, etc.).
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
+#include <iterator>
+#include <numeric>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * C++ has its own implementation of iterator that works with a different
  * generics containers defined by the standard library.
  */
 
+/**
+ * A lazy pipeline of transformations over a range. Filter, Map and Take only
+ * wrap the stage before them and nothing runs until a terminal operation
+ * (ForEach, Reduce, CollectInto) pushes the elements through every stage in a
+ * single loop, without intermediate containers. Stages are plain template
+ * types, so the compiler sees the whole fused loop and can inline and
+ * vectorize it.
+ *
+ * A source is a callable that feeds each element to a sink and stops early
+ * when the sink returns false.
+ */
+template <typename Source>
+class Pipeline {
+ public:
+  explicit Pipeline(Source source) : source_(std::move(source)) {
+  }
+
+  template <typename P>
+  auto Filter(P predicate) const {
+    auto stage = [source = source_, predicate](auto &&sink) {
+      return source([&](auto &&value) { return predicate(value) ? sink(std::forward<decltype(value)>(value)) : true; });
+    };
+    return Pipeline<decltype(stage)>(stage);
+  }
+
+  template <typename F>
+  auto Map(F f) const {
+    auto stage = [source = source_, f](auto &&sink) {
+      return source([&](auto &&value) { return sink(f(std::forward<decltype(value)>(value))); });
+    };
+    return Pipeline<decltype(stage)>(stage);
+  }
+
+  auto Take(std::size_t n) const {
+    auto stage = [source = source_, n](auto &&sink) {
+      std::size_t taken = 0;
+      return n == 0 || source([&](auto &&value) { return sink(std::forward<decltype(value)>(value)) && ++taken < n; });
+    };
+    return Pipeline<decltype(stage)>(stage);
+  }
+
+  template <typename F>
+  void ForEach(F f) const {
+    source_([&](auto &&value) {
+      f(std::forward<decltype(value)>(value));
+      return true;
+    });
+  }
+
+  template <typename R, typename Op>
+  R Reduce(R init, Op op) const {
+    source_([&](auto &&value) {
+      init = op(std::move(init), std::forward<decltype(value)>(value));
+      return true;
+    });
+    return init;
+  }
+
+  template <typename C>
+  void CollectInto(C &container) const {
+    ForEach([&container](auto &&value) { container.Add(std::forward<decltype(value)>(value)); });
+  }
+
+ private:
+  Source source_;
+};
+
+/**
+ * The Iterator is a small value built on the collection's own STL iterators.
+ * It keeps the range it walks next to its position instead of reaching back
+ * into the collection, so a loop over it compiles down to the same pointer
+ * walk as a plain for loop. It must not outlive changes to the collection.
+ */
 template <typename T, typename U>
 class Iterator {
  public:
-  typedef typename std::vector<T>::iterator iter_type;
-  Iterator(U *p_data, bool reverse = false) : m_p_data_(p_data) {
-    m_it_ = m_p_data_->m_data_.begin();
+  typedef typename U::iterator iter_type;
+  Iterator(U *p_data, bool reverse = false) : m_begin_(p_data->begin()), m_end_(p_data->end()), m_it_(m_begin_) {
   }
 
   void First() {
-    m_it_ = m_p_data_->m_data_.begin();
+    m_it_ = m_begin_;
   }
 
   void Next() {
@@ -39,38 +129,563 @@ class Iterator {
   }
 
   bool IsDone() {
-    return (m_it_ == m_p_data_->m_data_.end());
+    return (m_it_ == m_end_);
   }
 
   iter_type Current() {
     return m_it_;
   }
 
+  /**
+   * Lazy pipelines over the elements from the current position to the end.
+   */
+  auto AsPipeline() const {
+    auto source = [it = m_it_, end = m_end_](auto &&sink) {
+      for (iter_type i = it; i != end; ++i) {
+        if (!sink(*i)) {
+          return false;
+        }
+      }
+      return true;
+    };
+    return Pipeline<decltype(source)>(source);
+  }
+  template <typename P>
+  auto Filter(P predicate) const {
+    return AsPipeline().Filter(predicate);
+  }
+  template <typename F>
+  auto Map(F f) const {
+    return AsPipeline().Map(f);
+  }
+  auto Take(std::size_t n) const {
+    return AsPipeline().Take(n);
+  }
+
  private:
-  U *m_p_data_;
+  iter_type m_begin_;
+  iter_type m_end_;
   iter_type m_it_;
 };
 
+/**
+ * A storage policy for Container that keeps trivially copyable elements in a
+ * memory-mapped file rather than in RAM, e.g. Container<int, MappedStorage<int>>.
+ * Elements already in the file are available at startup without reloading
+ * them, pages are read on demand as iteration reaches them (with a sequential
+ * read-ahead hint), and push_back appends to the file, growing the mapping
+ * geometrically. The file starts with a small header that records how many
+ * elements it holds, so the spare capacity at its end is never mistaken for
+ * elements, even when the process exits without running the destructor. On
+ * destruction the file is trimmed to the elements it holds.
+ */
+template <typename T>
+class MappedStorage {
+  static_assert(std::is_trivially_copyable_v<T>, "MappedStorage needs trivially copyable elements");
+
+ public:
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  explicit MappedStorage(const std::string &path)
+      : m_path_(path), m_header_(nullptr), m_data_(nullptr), m_size_(0), m_capacity_(0) {
+    m_fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd_ < 0) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    try {
+      struct stat st;
+      if (fstat(m_fd_, &st) != 0) {
+        throw std::runtime_error("cannot stat " + path);
+      }
+      const std::size_t bytes = static_cast<std::size_t>(st.st_size);
+      if (bytes == 0) {
+        Map(kMinCapacity);
+        m_header_->magic = kMagic;
+        m_header_->size = 0;
+      } else {
+        if (bytes < kHeaderBytes) {
+          throw std::runtime_error(path + " is not a MappedStorage file");
+        }
+        Map(std::max((bytes - kHeaderBytes) / sizeof(T), kMinCapacity));
+        if (m_header_->magic != kMagic || m_header_->size > (bytes - kHeaderBytes) / sizeof(T)) {
+          throw std::runtime_error(path + " is not a MappedStorage file");
+        }
+        m_size_ = m_header_->size;
+      }
+    } catch (...) {
+      if (m_header_) {
+        munmap(m_header_, Bytes(m_capacity_));
+      }
+      close(m_fd_);
+      throw;
+    }
+  }
+  MappedStorage(MappedStorage &&other)
+      : m_path_(std::move(other.m_path_)),
+        m_fd_(other.m_fd_),
+        m_header_(other.m_header_),
+        m_data_(other.m_data_),
+        m_size_(other.m_size_),
+        m_capacity_(other.m_capacity_) {
+    other.m_fd_ = -1;
+    other.m_header_ = nullptr;
+    other.m_data_ = nullptr;
+  }
+  MappedStorage(const MappedStorage &) = delete;
+  MappedStorage &operator=(const MappedStorage &) = delete;
+  ~MappedStorage() {
+    if (m_fd_ < 0) {
+      return;
+    }
+    munmap(m_header_, Bytes(m_capacity_));
+    if (ftruncate(m_fd_, Bytes(m_size_)) != 0) {
+      std::perror(m_path_.c_str());
+    }
+    close(m_fd_);
+  }
+
+  void push_back(const T &value) {
+    if (m_size_ == m_capacity_) {
+      Map(m_capacity_ * 2);
+    }
+    m_data_[m_size_++] = value;
+    m_header_->size = m_size_;
+  }
+  T *data() {
+    return m_data_;
+  }
+  iterator begin() {
+    return m_data_;
+  }
+  iterator end() {
+    return m_data_ + m_size_;
+  }
+  const_iterator begin() const {
+    return m_data_;
+  }
+  const_iterator end() const {
+    return m_data_ + m_size_;
+  }
+  std::size_t size() const {
+    return m_size_;
+  }
+
+ private:
+  struct Header {
+    std::uint64_t magic;
+    std::uint64_t size;
+  };
+
+  static constexpr std::uint64_t kMagic = 0x4d61707065645631;  // "MappedV1"
+  static constexpr std::size_t kHeaderBytes = 64;
+  static constexpr std::size_t kMinCapacity = (4096 + sizeof(T) - 1) / sizeof(T);
+  static_assert(alignof(T) <= kHeaderBytes, "MappedStorage elements must fit the header alignment");
+
+  static std::size_t Bytes(std::size_t capacity) {
+    return kHeaderBytes + capacity * sizeof(T);
+  }
+
+  /**
+   * Sizes the file for at least `capacity` elements and maps all of it. The
+   * old mapping is only dropped once the new one is in place, so on failure
+   * the storage is left as it was.
+   */
+  void Map(std::size_t capacity) {
+    struct stat st;
+    if (fstat(m_fd_, &st) != 0) {
+      throw std::runtime_error("cannot stat " + m_path_);
+    }
+    if (static_cast<std::size_t>(st.st_size) < Bytes(capacity) && ftruncate(m_fd_, Bytes(capacity)) != 0) {
+      throw std::runtime_error("cannot grow " + m_path_);
+    }
+    void *map = mmap(nullptr, Bytes(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd_, 0);
+    if (map == MAP_FAILED) {
+      throw std::runtime_error("cannot map " + m_path_);
+    }
+    madvise(map, Bytes(capacity), MADV_SEQUENTIAL);
+    if (m_header_) {
+      munmap(m_header_, Bytes(m_capacity_));
+    }
+    m_header_ = static_cast<Header *>(map);
+    m_data_ = reinterpret_cast<T *>(static_cast<char *>(map) + kHeaderBytes);
+    m_capacity_ = capacity;
+  }
+
+  std::string m_path_;
+  int m_fd_;
+  Header *m_header_;
+  T *m_data_;
+  std::size_t m_size_;
+  std::size_t m_capacity_;
+};
+
 /**
  * Generic Collections/Containers provides one or several methods for retrieving
  * fresh iterator instances, compatible with the collection class.
+ *
+ * The Container also hands out its contiguous STL iterators through begin()
+ * and end(), so it works with range-for and the standard algorithms, and loops
+ * over it can be vectorized. The same iterators can be passed to the parallel
+ * algorithms, e.g. std::for_each(std::execution::par_unseq, c.begin(), c.end(),
+ * f), where the standard library has a parallel backend.
+ *
+ * For traversal on all cores without such a backend, Split() cuts the elements
+ * into chunks and ParallelForEach/ParallelReduce hand the chunks to a pool of
+ * threads, each thread taking the next unclaimed chunk as soon as it is free.
+ *
+ * Where the elements live is up to the Storage policy: a std::vector by
+ * default, or a MappedStorage file for data sets larger than RAM.
  */
 
-template <class T>
+template <class T, class Storage = std::vector<T>>
 class Container {
-  friend class Iterator<T, Container>;
-
  public:
+  typedef typename Storage::iterator iterator;
+  typedef typename Storage::const_iterator const_iterator;
+
+  Container() = default;
+  explicit Container(Storage storage) : m_data_(std::move(storage)) {
+  }
+
   void Add(T a) {
     m_data_.push_back(a);
   }
 
-  Iterator<T, Container> *CreateIterator() {
-    return new Iterator<T, Container>(this);
+  Iterator<T, Container> CreateIterator() {
+    return Iterator<T, Container>(this);
+  }
+  Iterator<T, Container> Iter() {
+    return CreateIterator();
+  }
+
+  iterator begin() {
+    return m_data_.begin();
+  }
+  iterator end() {
+    return m_data_.end();
+  }
+  const_iterator begin() const {
+    return m_data_.begin();
+  }
+  const_iterator end() const {
+    return m_data_.end();
+  }
+  std::size_t size() const {
+    return m_data_.size();
+  }
+
+  /**
+   * Cuts the elements into at most max_chunks contiguous chunks. Chunks start
+   * on cache-line boundaries where the element size allows it, so two threads
+   * never write to the same line.
+   */
+  std::vector<std::span<T>> Split(std::size_t max_chunks) {
+    std::vector<std::span<T>> chunks;
+    const std::size_t size = m_data_.size();
+    if (size == 0) {
+      return chunks;
+    }
+    max_chunks = std::max<std::size_t>(max_chunks, 1);
+    const std::size_t line = std::max<std::size_t>(kCacheLine / sizeof(T), 1);
+    std::size_t first_aligned = 0;
+    if (kCacheLine % sizeof(T) == 0) {
+      const std::size_t misalignment = reinterpret_cast<std::uintptr_t>(m_data_.data()) % kCacheLine;
+      first_aligned = std::min(((kCacheLine - misalignment) % kCacheLine) / sizeof(T), size);
+    }
+    const std::size_t per_chunk = (size + max_chunks - 1) / max_chunks;
+    std::size_t begin = 0;
+    while (begin < size) {
+      std::size_t end = begin + per_chunk;
+      if (end > first_aligned) {
+        end = first_aligned + (end - first_aligned + line - 1) / line * line;
+      }
+      end = std::min(end, size);
+      chunks.emplace_back(m_data_.data() + begin, end - begin);
+      begin = end;
+    }
+    return chunks;
+  }
+
+  /**
+   * Calls f on every element, spread over the given number of threads.
+   */
+  template <typename F>
+  void ParallelForEach(F f, std::size_t threads = std::thread::hardware_concurrency()) {
+    const std::vector<std::span<T>> chunks = Split(std::max<std::size_t>(threads, 1) * 4);
+    RunChunks(chunks.size(), threads, [&](std::size_t index) {
+      for (T &element : chunks[index]) {
+        f(element);
+      }
+    });
+  }
+
+  /**
+   * Folds all elements with op. Each chunk is folded left to right in
+   * parallel and the chunk results are then combined in chunk order, so op
+   * must be associative but need not be commutative, and identity must leave
+   * any value unchanged (0 for +, 1 for *).
+   */
+  template <typename R, typename Op>
+  R ParallelReduce(R identity, Op op, std::size_t threads = std::thread::hardware_concurrency()) {
+    const std::vector<std::span<T>> chunks = Split(std::max<std::size_t>(threads, 1) * 4);
+    std::vector<R> partials(chunks.size(), identity);
+    RunChunks(chunks.size(), threads, [&](std::size_t index) {
+      partials[index] = std::accumulate(chunks[index].begin(), chunks[index].end(), identity, op);
+    });
+    return std::accumulate(partials.begin(), partials.end(), identity, op);
   }
 
  private:
-  std::vector<T> m_data_;
+  static constexpr std::size_t kCacheLine = 64;
+
+  /**
+   * Calls work(index) for every chunk index on up to `threads` threads. There
+   * are a few chunks per thread and each thread claims the next one as soon as
+   * it is free, so threads that finish early take over work from slow ones.
+   */
+  template <typename Work>
+  static void RunChunks(std::size_t count, std::size_t threads, Work work) {
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+      for (std::size_t index = next++; index < count; index = next++) {
+        work(index);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (std::size_t i = 1; i < std::min(threads, count); i++) {
+      pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : pool) {
+      t.join();
+    }
+  }
+
+  Storage m_data_;
+};
+
+static_assert(std::contiguous_iterator<Container<int>::iterator>);
+
+/**
+ * Names the fields of an aggregate for SoAContainer. Specialize it with a tuple
+ * of member pointers, e.g.
+ *
+ *   template <>
+ *   struct SoALayout<Particle> {
+ *     static constexpr auto fields = std::make_tuple(&Particle::x, &Particle::y);
+ *   };
+ */
+template <typename T>
+struct SoALayout;
+
+/**
+ * A Container that stores an aggregate struct-of-arrays style: each field in a
+ * contiguous array of its own. A scan that reads one field then streams only
+ * that array, and Column<I>() hands it out as a span the compiler can
+ * vectorize over. Iterators yield proxy references that convert to and assign
+ * from T, so loops written against Container keep compiling.
+ */
+template <typename T>
+class SoAContainer {
+  template <typename M>
+  struct FieldOf;
+  template <typename C, typename F>
+  struct FieldOf<F C::*> {
+    typedef F type;
+  };
+  template <typename Fields>
+  struct ColumnsOf;
+  template <typename... M>
+  struct ColumnsOf<std::tuple<M...>> {
+    typedef std::tuple<std::vector<typename FieldOf<M>::type>...> type;
+  };
+
+  static constexpr auto &kFields = SoALayout<T>::fields;
+  static constexpr std::size_t kFieldCount = std::tuple_size_v<std::remove_cvref_t<decltype(kFields)>>;
+  typedef typename ColumnsOf<std::remove_cvref_t<decltype(kFields)>>::type Columns;
+
+ public:
+  /**
+   * Stands for the element at one index.
+   */
+  class Reference {
+   public:
+    Reference(SoAContainer *p_data, std::size_t index) : m_p_data_(p_data), m_index_(index) {
+    }
+    Reference(const Reference &other) = default;
+    operator T() const {
+      return m_p_data_->Load(m_index_);
+    }
+    Reference &operator=(const T &value) {
+      m_p_data_->Store(m_index_, value);
+      return *this;
+    }
+    /**
+     * Copies the element, not the binding, so *dst = *src writes through.
+     */
+    Reference &operator=(const Reference &other) {
+      return *this = static_cast<T>(other);
+    }
+    friend void swap(Reference a, Reference b) {
+      T value = a;
+      a = static_cast<T>(b);
+      b = value;
+    }
+    template <std::size_t I>
+    auto &get() const {
+      return m_p_data_->template Column<I>()[m_index_];
+    }
+
+   private:
+    SoAContainer *m_p_data_;
+    std::size_t m_index_;
+  };
+
+  /**
+   * What iterator-> returns: a copy of the element that lives as long as the
+   * expression, for read access through member syntax.
+   */
+  class Arrow {
+   public:
+    explicit Arrow(T value) : m_value_(value) {
+    }
+    const T *operator->() const {
+      return &m_value_;
+    }
+
+   private:
+    T m_value_;
+  };
+
+  /**
+   * Random access for C++20 algorithms; the legacy category stays at input
+   * because *it is a proxy, not a T&.
+   */
+  class iterator {
+   public:
+    typedef std::random_access_iterator_tag iterator_concept;
+    typedef std::input_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Reference reference;
+    typedef Arrow pointer;
+
+    iterator() : m_p_data_(nullptr), m_index_(0) {
+    }
+    iterator(SoAContainer *p_data, std::size_t index) : m_p_data_(p_data), m_index_(index) {
+    }
+    Reference operator*() const {
+      return Reference(m_p_data_, m_index_);
+    }
+    Arrow operator->() const {
+      return Arrow(m_p_data_->Load(m_index_));
+    }
+    Reference operator[](difference_type n) const {
+      return Reference(m_p_data_, m_index_ + n);
+    }
+    iterator &operator++() {
+      ++m_index_;
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator old = *this;
+      ++m_index_;
+      return old;
+    }
+    iterator &operator--() {
+      --m_index_;
+      return *this;
+    }
+    iterator operator--(int) {
+      iterator old = *this;
+      --m_index_;
+      return old;
+    }
+    iterator &operator+=(difference_type n) {
+      m_index_ += n;
+      return *this;
+    }
+    iterator &operator-=(difference_type n) {
+      m_index_ -= n;
+      return *this;
+    }
+    iterator operator+(difference_type n) const {
+      return iterator(m_p_data_, m_index_ + n);
+    }
+    friend iterator operator+(difference_type n, const iterator &it) {
+      return it + n;
+    }
+    iterator operator-(difference_type n) const {
+      return iterator(m_p_data_, m_index_ - n);
+    }
+    difference_type operator-(const iterator &other) const {
+      return static_cast<difference_type>(m_index_) - static_cast<difference_type>(other.m_index_);
+    }
+    bool operator==(const iterator &other) const {
+      return m_index_ == other.m_index_;
+    }
+    auto operator<=>(const iterator &other) const {
+      return m_index_ <=> other.m_index_;
+    }
+
+   private:
+    SoAContainer *m_p_data_;
+    std::size_t m_index_;
+  };
+
+  void Add(const T &a) {
+    AddFields(a, std::make_index_sequence<kFieldCount>());
+  }
+
+  Iterator<T, SoAContainer> CreateIterator() {
+    return Iterator<T, SoAContainer>(this);
+  }
+  Iterator<T, SoAContainer> Iter() {
+    return CreateIterator();
+  }
+
+  iterator begin() {
+    return iterator(this, 0);
+  }
+  iterator end() {
+    return iterator(this, size());
+  }
+  std::size_t size() const {
+    return std::get<0>(m_columns_).size();
+  }
+
+  /**
+   * All values of the I-th field listed in SoALayout<T>, contiguous.
+   */
+  template <std::size_t I>
+  auto Column() {
+    return std::span(std::get<I>(m_columns_));
+  }
+
+ private:
+  template <std::size_t... I>
+  void AddFields(const T &a, std::index_sequence<I...>) {
+    (std::get<I>(m_columns_).push_back(a.*std::get<I>(kFields)), ...);
+  }
+  T Load(std::size_t index) const {
+    T value{};
+    LoadFields(index, value, std::make_index_sequence<kFieldCount>());
+    return value;
+  }
+  template <std::size_t... I>
+  void LoadFields(std::size_t index, T &value, std::index_sequence<I...>) const {
+    ((value.*std::get<I>(kFields) = std::get<I>(m_columns_)[index]), ...);
+  }
+  void Store(std::size_t index, const T &value) {
+    StoreFields(index, value, std::make_index_sequence<kFieldCount>());
+  }
+  template <std::size_t... I>
+  void StoreFields(std::size_t index, const T &value, std::index_sequence<I...>) {
+    ((std::get<I>(m_columns_)[index] = value.*std::get<I>(kFields)), ...);
+  }
+
+  Columns m_columns_;
 };
 
 class Data {
@@ -89,6 +704,23 @@ class Data {
   int m_data_;
 };
 
+/**
+ * A record with several fields, laid out struct-of-arrays in SoAContainer.
+ */
+struct Particle {
+  float x;
+  float y;
+  int id;
+};
+
+template <>
+struct SoALayout<Particle> {
+  static constexpr auto fields = std::make_tuple(&Particle::x, &Particle::y, &Particle::id);
+};
+
+static_assert(std::random_access_iterator<SoAContainer<Particle>::iterator>);
+static_assert(std::is_copy_assignable_v<SoAContainer<Particle>::Reference>);
+
 /**
  * The client code may or may not know about the Concrete Iterator or Collection
  * classes, for this implementation the container is generic so you can used
@@ -102,10 +734,39 @@ void ClientCode() {
     cont.Add(i);
   }
 
-  Iterator<int, Container<int>> *it = cont.CreateIterator();
-  for (it->First(); !it->IsDone(); it->Next()) {
-    std::cout << *it->Current() << std::endl;
+  Iterator<int, Container<int>> it = cont.CreateIterator();
+  for (it.First(); !it.IsDone(); it.Next()) {
+    std::cout << *it.Current() << std::endl;
+  }
+  std::cout << "Sum: " << std::accumulate(cont.begin(), cont.end(), 0) << std::endl;
+  cont.ParallelForEach([](int &i) { i *= 2; });
+  std::cout << "Parallel sum after doubling: " << cont.ParallelReduce(0, std::plus<int>()) << std::endl;
+  std::cout << "First two squares of multiples of 3:";
+  cont.Iter()
+      .Filter([](int i) { return i % 3 == 0; })
+      .Map([](int i) { return i * i; })
+      .Take(2)
+      .ForEach([](int i) { std::cout << " " << i; });
+  std::cout << std::endl;
+
+  Container<int> big;
+  for (int i = 0; i < 10000000; i++) {
+    big.Add(i % 1000);
   }
+  const auto old_start = std::chrono::steady_clock::now();
+  long long old_sum = 0;
+  Iterator<int, Container<int>> big_it = big.CreateIterator();
+  for (big_it.First(); !big_it.IsDone(); big_it.Next()) {
+    old_sum += *big_it.Current();
+  }
+  const auto new_start = std::chrono::steady_clock::now();
+  const long long new_sum = std::accumulate(big.begin(), big.end(), 0LL);
+  const auto new_end = std::chrono::steady_clock::now();
+  std::cout << "Sum of 10M ints: " << old_sum << " in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(new_start - old_start).count()
+            << " us through First/Next/IsDone/Current, " << new_sum << " in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(new_end - new_start).count()
+            << " us through begin()/end()" << std::endl;
 
   Container<Data> cont2;
   Data a(100), b(1000), c(10000);
@@ -114,12 +775,50 @@ void ClientCode() {
   cont2.Add(c);
 
   std::cout << "________________Iterator with custom Class______________________________" << std::endl;
-  Iterator<Data, Container<Data>> *it2 = cont2.CreateIterator();
-  for (it2->First(); !it2->IsDone(); it2->Next()) {
-    std::cout << it2->Current()->data() << std::endl;
+  Iterator<Data, Container<Data>> it2 = cont2.CreateIterator();
+  for (it2.First(); !it2.IsDone(); it2.Next()) {
+    std::cout << it2.Current()->data() << std::endl;
+  }
+  std::cout << "Sum: " << cont2.Iter().Map([](Data &d) { return d.data(); }).Reduce(0, std::plus<int>()) << std::endl;
+
+  std::cout << "________________Iterator over a memory-mapped file_____________________" << std::endl;
+  {
+    Container<int, MappedStorage<int>> mapped(MappedStorage<int>("iterator_container.bin"));
+    for (int i = 0; i < 5; i++) {
+      mapped.Add(i * i);
+    }
+  }
+  {
+    Container<int, MappedStorage<int>> reopened(MappedStorage<int>("iterator_container.bin"));
+    Iterator<int, Container<int, MappedStorage<int>>> it3 = reopened.CreateIterator();
+    for (it3.First(); !it3.IsDone(); it3.Next()) {
+      std::cout << *it3.Current() << std::endl;
+    }
+  }
+  std::remove("iterator_container.bin");
+
+  std::cout << "________________Iterator over a struct-of-arrays container_____________" << std::endl;
+  SoAContainer<Particle> particles;
+  particles.Add({1.5f, 2.0f, 7});
+  particles.Add({2.5f, 3.0f, 8});
+  particles.Add({3.5f, 4.0f, 9});
+  Iterator<Particle, SoAContainer<Particle>> it4 = particles.CreateIterator();
+  for (it4.First(); !it4.IsDone(); it4.Next()) {
+    std::cout << it4.Current()->id << std::endl;
+  }
+  std::span<float> xs = particles.Column<0>();
+  std::cout << "Sum of x: " << std::accumulate(xs.begin(), xs.end(), 0.0f) << std::endl;
+  SoAContainer<Particle> copied;
+  for (std::size_t i = 0; i < particles.size(); i++) {
+    copied.Add({});
+  }
+  std::copy(particles.begin(), particles.end(), copied.begin());
+  std::sort(copied.begin(), copied.end(), [](const Particle &l, const Particle &r) { return l.id > r.id; });
+  std::cout << "Copied and sorted by id, descending:";
+  for (Particle p : copied) {
+    std::cout << " " << p.id;
   }
-  delete it;
-  delete it2;
+  std::cout << std::endl;
 }
 
 int main() {
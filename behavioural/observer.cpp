@@ -16,14 +16,68 @@ The Observer pattern provides a way to subscribe and unsubscribe to and from the
  * Also the verbs "observe", "listen" or "track" usually mean the same thing.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
-#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+/**
+ * A message travels as an immutable, reference-counted payload. A broadcast
+ * hands every observer the same payload, and an observer that wants to keep it
+ * holds on to the pointer instead of copying the contents. Besides text, a
+ * payload can carry a plain number, so publishers of numbers do not have to
+ * format them into strings.
+ */
+using Payload = std::variant<std::string, long, double>;
+using Message = std::shared_ptr<const Payload>;
+
+Message MakeMessage(Payload payload) {
+  return std::make_shared<const Payload>(std::move(payload));
+}
+
+std::string ToString(const Payload &payload) {
+  if (const std::string *text = std::get_if<std::string>(&payload)) {
+    return *text;
+  }
+  if (const long *number = std::get_if<long>(&payload)) {
+    return std::to_string(*number);
+  }
+  return std::to_string(std::get<double>(payload));
+}
 
 class IObserver {
  public:
   virtual ~IObserver(){};
   virtual void Update(const std::string &message_from_subject) = 0;
+  /**
+   * Observers that override this get the shared payload itself; by default it
+   * is turned into text for Update above.
+   */
+  virtual void Update(const Message &message_from_subject) {
+    Update(ToString(*message_from_subject));
+  }
+  /**
+   * Several changes delivered at once by a coalescing subject, oldest first.
+   * By default only the latest one is passed on.
+   */
+  virtual void UpdateBatch(std::span<const Message> messages_from_subject) {
+    if (!messages_from_subject.empty()) {
+      Update(messages_from_subject.back());
+    }
+  }
 };
 
 class ISubject {
@@ -32,15 +86,90 @@ class ISubject {
   virtual void Attach(IObserver *observer) = 0;
   virtual void Detach(IObserver *observer) = 0;
   virtual void Notify() = 0;
+  /**
+   * Subscriptions to a single topic. A subject without topics keeps track of
+   * the topics each observer asked for, attaches it on the first and detaches
+   * it after the last, so the observer hears every message exactly once. Such
+   * a subject cannot tell those attachments from plain ones: an observer
+   * should either be attached to it or subscribed, not both, and one observer's
+   * subscriptions should be changed from one thread at a time.
+   */
+  virtual void Subscribe(IObserver *observer, const std::string &topic) {
+    {
+      std::lock_guard<std::mutex> lock(topics_mutex_);
+      std::unordered_set<std::string> &topics = topics_of_[observer];
+      if (!topics.insert(topic).second || topics.size() > 1) {
+        return;
+      }
+    }
+    try {
+      Attach(observer);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(topics_mutex_);
+      topics_of_.erase(observer);
+      throw;
+    }
+  }
+  virtual void Unsubscribe(IObserver *observer, const std::string &topic) {
+    {
+      std::lock_guard<std::mutex> lock(topics_mutex_);
+      auto found = topics_of_.find(observer);
+      if (found == topics_of_.end() || found->second.erase(topic) == 0 || !found->second.empty()) {
+        return;
+      }
+      topics_of_.erase(found);
+    }
+    Detach(observer);
+  }
+
+ private:
+  std::mutex topics_mutex_;
+  std::unordered_map<IObserver *, std::unordered_set<std::string>> topics_of_;
 };
 
+/**
+ * Identifies one attachment to a Subject. The generation tells a handle to a
+ * reused slot apart from the handle of its earlier occupant.
+ */
+struct SubscriptionId {
+  std::uint32_t slot;
+  std::uint32_t generation;
+};
+
+class Subscription;
+
 /**
  * The Subject owns some important state and notifies observers when the state
  * changes.
+ *
+ * The observers sit in one contiguous array that Notify walks in order. Every
+ * attachment also owns a slot that records where its observer sits in that
+ * array, so detaching by handle moves the last observer into the gap in O(1)
+ * instead of searching a list. Observers must not attach or detach from
+ * inside Update.
+ *
+ * A subject that changes faster than its observers need to hear about it can
+ * coalesce: changes are collected, and observers get them in one UpdateBatch
+ * call once max_batch of them have piled up or window has passed since the
+ * first one. The subject has no thread of its own, so the window is checked
+ * as changes arrive; when changes stop, the caller's event loop arms a timer
+ * for FlushDeadline() and calls FlushIfDue() when it fires, so the last
+ * changes still go out within the window.
  */
 
 class Subject : public ISubject {
  public:
+  /**
+   * How many changes there were and how many notifications carried them.
+   */
+  struct CoalescingStats {
+    std::uint64_t changes = 0;
+    std::uint64_t notifications = 0;
+    double Ratio() const {
+      return notifications ? static_cast<double>(changes) / notifications : 0.0;
+    }
+  };
+
   virtual ~Subject() {
     std::cout << "Goodbye, I was the Subject.\n";
   }
@@ -49,26 +178,125 @@ class Subject : public ISubject {
    * The subscription management methods.
    */
   void Attach(IObserver *observer) override {
-    list_observer_.push_back(observer);
+    AttachWithId(observer);
   }
+  /**
+   * Detaches every attachment of the observer.
+   */
   void Detach(IObserver *observer) override {
-    list_observer_.remove(observer);
+    auto range = by_observer_.equal_range(observer);
+    std::vector<SubscriptionId> ids;
+    for (auto it = range.first; it != range.second; ++it) {
+      ids.push_back(it->second);
+    }
+    for (SubscriptionId id : ids) {
+      Detach(id);
+    }
+  }
+  /**
+   * Attaches the observer and returns a handle that detaches it when it goes
+   * out of scope.
+   */
+  Subscription Connect(IObserver *observer);
+  SubscriptionId AttachWithId(IObserver *observer) {
+    std::uint32_t slot;
+    if (free_slots_.empty()) {
+      slot = static_cast<std::uint32_t>(slots_.size());
+      slots_.push_back(Slot{0, 0});
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    slots_[slot].dense = static_cast<std::uint32_t>(observers_.size());
+    observers_.push_back(observer);
+    dense_to_slot_.push_back(slot);
+    const SubscriptionId id{slot, slots_[slot].generation};
+    by_observer_.emplace(observer, id);
+    return id;
+  }
+  /**
+   * Does nothing for a handle that was already detached.
+   */
+  void Detach(SubscriptionId id) {
+    if (id.slot >= slots_.size() || slots_[id.slot].generation != id.generation) {
+      return;
+    }
+    const std::uint32_t dense = slots_[id.slot].dense;
+    IObserver *observer = observers_[dense];
+    observers_[dense] = observers_.back();
+    dense_to_slot_[dense] = dense_to_slot_.back();
+    slots_[dense_to_slot_[dense]].dense = dense;
+    observers_.pop_back();
+    dense_to_slot_.pop_back();
+    slots_[id.slot].generation++;
+    free_slots_.push_back(id.slot);
+    auto range = by_observer_.equal_range(observer);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.slot == id.slot) {
+        by_observer_.erase(it);
+        break;
+      }
+    }
   }
   void Notify() override {
-    std::list<IObserver *>::iterator iterator = list_observer_.begin();
     HowManyObserver();
-    while (iterator != list_observer_.end()) {
-      (*iterator)->Update(message_);
-      ++iterator;
+    for (IObserver *observer : observers_) {
+      observer->Update(this->message_);
     }
   }
 
   void CreateMessage(std::string message = "Empty") {
-    this->message_ = message;
-    Notify();
+    this->message_ = MakeMessage(std::move(message));
+    Changed();
+  }
+  void CreateMessage(Message message) {
+    this->message_ = std::move(message);
+    Changed();
+  }
+  /**
+   * A max_batch of 0 turns coalescing off and delivers what is waiting.
+   */
+  void SetCoalescing(std::size_t max_batch, std::chrono::steady_clock::duration window = std::chrono::milliseconds(1)) {
+    max_batch_ = max_batch;
+    window_ = window;
+    if (max_batch == 0) {
+      Flush();
+    }
+  }
+  void Flush() {
+    if (pending_.empty()) {
+      return;
+    }
+    for (IObserver *observer : observers_) {
+      observer->UpdateBatch(pending_);
+    }
+    stats_.notifications++;
+    pending_.clear();
+  }
+  /**
+   * When the changes waiting now are due, or nothing when none are waiting.
+   */
+  std::optional<std::chrono::steady_clock::time_point> FlushDeadline() const {
+    if (pending_.empty()) {
+      return std::nullopt;
+    }
+    return first_pending_ + window_;
+  }
+  /**
+   * Delivers what is waiting if its window has passed. Returns whether it did.
+   */
+  bool FlushIfDue(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+    if (pending_.empty() || now - first_pending_ < window_) {
+      return false;
+    }
+    Flush();
+    return true;
+  }
+  const CoalescingStats &coalescing_stats() const {
+    return stats_;
   }
   void HowManyObserver() {
-    std::cout << "There are " << list_observer_.size() << " observers in the list.\n";
+    std::cout << "There are " << observers_.size() << " observers in the list.\n";
   }
 
   /**
@@ -78,16 +306,105 @@ class Subject : public ISubject {
    * happen (or after it).
    */
   void SomeBusinessLogic() {
-    this->message_ = "change message message";
-    Notify();
+    this->message_ = MakeMessage(std::string("change message message"));
+    Changed();
     std::cout << "I'm about to do some thing important\n";
   }
 
  private:
-  std::list<IObserver *> list_observer_;
-  std::string message_;
+  struct Slot {
+    std::uint32_t dense;
+    std::uint32_t generation;
+  };
+
+  /**
+   * Every change of state ends up here: notified right away, or collected
+   * while coalescing.
+   */
+  void Changed() {
+    stats_.changes++;
+    if (max_batch_ == 0) {
+      stats_.notifications++;
+      Notify();
+      return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (pending_.empty()) {
+      first_pending_ = now;
+    }
+    pending_.push_back(this->message_);
+    if (pending_.size() >= max_batch_) {
+      Flush();
+    } else {
+      FlushIfDue(now);
+    }
+  }
+
+  std::vector<IObserver *> observers_;
+  std::vector<std::uint32_t> dense_to_slot_;
+  std::vector<Slot> slots_;
+  std::vector<std::uint32_t> free_slots_;
+  std::unordered_multimap<IObserver *, SubscriptionId> by_observer_;
+  Message message_;
+  std::size_t max_batch_ = 0;
+  std::chrono::steady_clock::duration window_{};
+  std::chrono::steady_clock::time_point first_pending_;
+  std::vector<Message> pending_;
+  CoalescingStats stats_;
+};
+
+/**
+ * Owns one attachment to a Subject and detaches it on destruction, unless it
+ * was released. The Subject must outlive it.
+ */
+class Subscription {
+ public:
+  Subscription(Subject *subject, SubscriptionId id) : subject_(subject), id_(id) {
+  }
+  Subscription(Subscription &&other) : subject_(other.subject_), id_(other.id_) {
+    other.subject_ = nullptr;
+  }
+  Subscription &operator=(Subscription &&other) {
+    if (this != &other) {
+      Reset();
+      subject_ = other.subject_;
+      id_ = other.id_;
+      other.subject_ = nullptr;
+    }
+    return *this;
+  }
+  Subscription(const Subscription &) = delete;
+  Subscription &operator=(const Subscription &) = delete;
+  ~Subscription() {
+    Reset();
+  }
+
+  /**
+   * Detaches now.
+   */
+  void Reset() {
+    if (subject_) {
+      subject_->Detach(id_);
+      subject_ = nullptr;
+    }
+  }
+  /**
+   * Keeps the observer attached and hands back the plain handle.
+   */
+  SubscriptionId Release() {
+    subject_ = nullptr;
+    return id_;
+  }
+
+ private:
+  Subject *subject_;
+  SubscriptionId id_;
 };
 
+Subscription Subject::Connect(IObserver *observer) {
+  return Subscription(this, AttachWithId(observer));
+}
+
 class Observer : public IObserver {
  public:
   Observer(Subject &subject) : subject_(subject) {
@@ -100,6 +417,12 @@ class Observer : public IObserver {
   }
 
   void Update(const std::string &message_from_subject) override {
+    Update(MakeMessage(message_from_subject));
+  }
+  /**
+   * Keeps the shared payload rather than a copy of its text.
+   */
+  void Update(const Message &message_from_subject) override {
     message_from_subject_ = message_from_subject;
     PrintInfo();
   }
@@ -108,11 +431,11 @@ class Observer : public IObserver {
     std::cout << "Observer \"" << number_ << "\" removed from the list.\n";
   }
   void PrintInfo() {
-    std::cout << "Observer \"" << this->number_ << "\": a new message is available --> " << this->message_from_subject_ << "\n";
+    std::cout << "Observer \"" << this->number_ << "\": a new message is available --> " << ToString(*this->message_from_subject_) << "\n";
   }
 
  private:
-  std::string message_from_subject_;
+  Message message_from_subject_;
   Subject &subject_;
   static int static_number_;
   int number_;
@@ -120,6 +443,585 @@ class Observer : public IObserver {
 
 int Observer::static_number_ = 0;
 
+/**
+ * A Subject that observers may join and leave from any thread while other
+ * threads notify. Notify() and CreateMessage() take no mutex: they read the
+ * current snapshot, an immutable list of observers published with a single
+ * atomic store, and hand the message to each observer by value. Only Attach
+ * and Detach copy the snapshot, change the copy and publish it, so publishers
+ * never wait for each other or for a slow observer. An old snapshot is freed
+ * once no
+ * notifier can still be reading it; that grace period is tracked RCU-style
+ * with two reader counters per epoch parity, and a writer flips the epoch and
+ * waits for the counters of the previous one to drain. As in ConcurrentChain,
+ * the counters are split into per-thread slots on separate cache lines, so
+ * concurrent notifiers do not contend on them.
+ *
+ * Update runs while its notifier is counted as a reader, so no observer may
+ * call Attach or Detach on the same subject from inside Update: the writer
+ * would wait for itself. Such calls throw logic_error. Publishing again from
+ * Update takes no writer path and is allowed.
+ */
+class ConcurrentSubject : public ISubject {
+ private:
+  struct Snapshot {
+    std::vector<IObserver *> observers;
+  };
+
+  /**
+   * Marks the calling thread as a reader of the current epoch for its scope.
+   */
+  class ReadSection {
+   public:
+    explicit ReadSection(ConcurrentSubject &subject) : subject_(&subject), outer_(innermost_) {
+      ReaderSlot &slot = subject.slots_[SlotIndex()];
+      for (;;) {
+        const unsigned epoch = subject.epoch_.load();
+        readers_ = &slot.readers[epoch & 1];
+        readers_->fetch_add(1);
+        if (subject.epoch_.load() == epoch) {
+          break;
+        }
+        readers_->fetch_sub(1);
+      }
+      innermost_ = this;
+    }
+    ~ReadSection() {
+      innermost_ = outer_;
+      readers_->fetch_sub(1);
+    }
+    /**
+     * Whether the calling thread is inside a notification of the subject.
+     */
+    static bool Inside(const ConcurrentSubject *subject) {
+      for (const ReadSection *section = innermost_; section; section = section->outer_) {
+        if (section->subject_ == subject) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+   private:
+    static inline thread_local const ReadSection *innermost_ = nullptr;
+
+    const ConcurrentSubject *subject_;
+    const ReadSection *outer_;
+    std::atomic<int> *readers_;
+  };
+
+  static constexpr std::size_t kReaderSlots = 16;
+
+  struct alignas(64) ReaderSlot {
+    std::atomic<int> readers[2] = {0, 0};
+  };
+
+  static std::size_t SlotIndex() {
+    static std::atomic<std::size_t> next_slot(0);
+    thread_local const std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % kReaderSlots;
+    return slot;
+  }
+
+  alignas(64) std::atomic<const Snapshot *> current_;
+  std::atomic<unsigned> epoch_;
+  ReaderSlot slots_[kReaderSlots];
+  std::mutex writer_;
+
+  void CheckNotNotifying() const {
+    if (Notifying()) {
+      throw std::logic_error("ConcurrentSubject changed from inside Update");
+    }
+  }
+
+  /**
+   * Swaps in a new snapshot and returns once no notifier can still be reading
+   * the old one. Must be called with writer_ held.
+   */
+  void Publish(const Snapshot *snapshot) {
+    const Snapshot *old = current_.exchange(snapshot);
+    const unsigned epoch = epoch_.fetch_add(1);
+    for (ReaderSlot &slot : slots_) {
+      while (slot.readers[epoch & 1].load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+    delete old;
+  }
+
+ public:
+  ConcurrentSubject() : current_(new Snapshot), epoch_(0), message_(MakeMessage(std::string("Empty"))) {
+  }
+  virtual ~ConcurrentSubject() {
+    delete current_.load();
+  }
+
+  void Attach(IObserver *observer) override {
+    CheckNotNotifying();
+    std::lock_guard<std::mutex> lock(writer_);
+    Snapshot *snapshot = new Snapshot(*current_.load());
+    snapshot->observers.push_back(observer);
+    Publish(snapshot);
+  }
+  /**
+   * Once Detach returns, the observer gets no further updates and may be
+   * destroyed.
+   */
+  void Detach(IObserver *observer) override {
+    CheckNotNotifying();
+    std::lock_guard<std::mutex> lock(writer_);
+    Snapshot *snapshot = new Snapshot(*current_.load());
+    snapshot->observers.erase(std::remove(snapshot->observers.begin(), snapshot->observers.end(), observer),
+                              snapshot->observers.end());
+    Publish(snapshot);
+  }
+  /**
+   * Sends the latest message again.
+   */
+  void Notify() override {
+    Deliver(message_.load());
+  }
+
+  void CreateMessage(std::string message = "Empty") {
+    CreateMessage(MakeMessage(std::move(message)));
+  }
+  void CreateMessage(Message message) {
+    message_.store(message);
+    Deliver(message);
+  }
+  /**
+   * Whether the calling thread is inside Update of one of this subject's
+   * observers, where Attach and Detach would throw.
+   */
+  bool Notifying() const {
+    return ReadSection::Inside(this);
+  }
+
+  /**
+   * Calls f with every attached observer under the same grace period as a
+   * notification, so an observer passed to f stays attached-or-alive until f
+   * returns.
+   */
+  template <typename F>
+  void ForEach(F f) {
+    ReadSection section(*this);
+    for (IObserver *observer : current_.load()->observers) {
+      f(observer);
+    }
+  }
+
+ private:
+  void Deliver(const Message &message) {
+    ForEach([&message](IObserver *observer) { observer->Update(message); });
+  }
+
+  std::atomic<Message> message_;
+};
+
+/**
+ * Bounded lock-free queue (Dmitry Vyukov's design). Each cell carries a
+ * sequence number telling producers and consumers whether it is free or full,
+ * so neither side takes a lock. The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(std::size_t capacity) : cells_(RoundUp(capacity)), mask_(cells_.size() - 1), head_(0), tail_(0) {
+    for (std::size_t i = 0; i < cells_.size(); i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  /**
+   * Returns false when the queue is full.
+   */
+  bool TryPush(const T &value) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells_[pos & mask_];
+      const std::intptr_t diff =
+          static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire)) - static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  /**
+   * Returns false when the queue is empty.
+   */
+  bool TryPop(T &value) {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells_[pos & mask_];
+      const std::intptr_t diff = static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire)) -
+                                 static_cast<std::intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  static std::size_t RoundUp(std::size_t capacity) {
+    std::size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  std::vector<Cell> cells_;
+  const std::size_t mask_;
+  alignas(64) std::atomic<std::size_t> head_;
+  alignas(64) std::atomic<std::size_t> tail_;
+};
+
+/**
+ * What an AsyncSubject does when an observer's mailbox is full: wait for room,
+ * drop the oldest queued message, or drop everything queued so the observer
+ * skips straight to the latest message.
+ */
+enum class OverflowPolicy { kBlock, kDropOldest, kCoalesceLatest };
+
+/**
+ * A Subject that delivers asynchronously. Every observer gets a bounded
+ * mailbox, and Notify() only drops the message into the mailboxes; a pool of
+ * worker threads drains them and calls Update. A slow observer therefore only
+ * falls behind on its own mailbox: the publisher and the other observers carry
+ * on, and what happens when its mailbox fills up is set by the OverflowPolicy.
+ * Each mailbox is drained by one worker at a time, so an observer sees its
+ * messages in order and is never called concurrently.
+ *
+ * The mailboxes are themselves attached to a ConcurrentSubject, so publishing
+ * takes no mutex either, and the workers walk the same observer snapshot. A
+ * worker that finds nothing to deliver sleeps until the next message is
+ * queued.
+ *
+ * Workers call Update from inside that snapshot walk, so no observer may call
+ * Attach or Detach on the subject from inside Update; such calls throw
+ * logic_error. An observer may publish again from Update, but under kBlock a
+ * full mailbox of its own would then never drain. An exception escaping
+ * Update is reported on std::cerr and the worker carries on with the next
+ * message.
+ */
+class AsyncSubject : public ISubject {
+ public:
+  /**
+   * How far an observer is behind: messages waiting in its mailbox, messages
+   * delivered, and messages dropped by the overflow policy.
+   */
+  struct ObserverLag {
+    IObserver *observer;
+    std::uint64_t queued;
+    std::uint64_t delivered;
+    std::uint64_t dropped;
+  };
+
+  explicit AsyncSubject(std::size_t workers = 2, std::size_t capacity = 1024,
+                        OverflowPolicy policy = OverflowPolicy::kBlock)
+      : capacity_(capacity), policy_(policy), stop_(false) {
+    for (std::size_t i = 0; i < std::max<std::size_t>(workers, 1); i++) {
+      workers_.emplace_back(&AsyncSubject::Run, this);
+    }
+  }
+  virtual ~AsyncSubject() {
+    stop_.store(true);
+    wake_.fetch_add(1);
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  void Attach(IObserver *observer) override {
+    CheckNotNotifying();
+    std::unique_ptr<Mailbox> mailbox = std::make_unique<Mailbox>(observer, capacity_, policy_, wake_);
+    Mailbox *attached = mailbox.get();
+    {
+      std::lock_guard<std::mutex> lock(mailboxes_mutex_);
+      mailboxes_.push_back(std::move(mailbox));
+    }
+    fan_out_.Attach(attached);
+  }
+  /**
+   * Once Detach returns, the observer gets no further updates; messages still
+   * in its mailbox are discarded.
+   */
+  void Detach(IObserver *observer) override {
+    CheckNotNotifying();
+    std::unique_ptr<Mailbox> mailbox;
+    {
+      std::lock_guard<std::mutex> lock(mailboxes_mutex_);
+      auto found = std::find_if(mailboxes_.begin(), mailboxes_.end(),
+                                [observer](const std::unique_ptr<Mailbox> &m) { return m->observer == observer; });
+      if (found == mailboxes_.end()) {
+        return;
+      }
+      mailbox = std::move(*found);
+      mailboxes_.erase(found);
+    }
+    // Returns once no publisher or worker can still be inside the mailbox.
+    fan_out_.Detach(mailbox.get());
+  }
+  void Notify() override {
+    fan_out_.Notify();
+  }
+  void CreateMessage(std::string message = "Empty") {
+    fan_out_.CreateMessage(std::move(message));
+  }
+  void CreateMessage(Message message) {
+    fan_out_.CreateMessage(std::move(message));
+  }
+
+  std::vector<ObserverLag> Lag() {
+    std::vector<ObserverLag> lag;
+    fan_out_.ForEach([&lag](IObserver *observer) {
+      const Mailbox *mailbox = static_cast<const Mailbox *>(observer);
+      const std::uint64_t delivered = mailbox->delivered.load();
+      const std::uint64_t dropped = mailbox->dropped.load();
+      lag.push_back({mailbox->observer, mailbox->enqueued.load() - delivered - dropped, delivered, dropped});
+    });
+    return lag;
+  }
+  /**
+   * Waits until every mailbox is empty.
+   */
+  void Flush() {
+    for (;;) {
+      bool empty = true;
+      for (const ObserverLag &lag : Lag()) {
+        empty = empty && lag.queued == 0;
+      }
+      if (empty) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  struct Mailbox : public IObserver {
+    Mailbox(IObserver *observer, std::size_t capacity, OverflowPolicy policy, std::atomic<std::uint32_t> &wake)
+        : observer(observer), queue(capacity), policy(policy), wake(wake) {
+    }
+    /**
+     * Called by the publisher: queues the message according to the policy.
+     */
+    void Update(const std::string &message_from_subject) override {
+      Update(MakeMessage(message_from_subject));
+    }
+    /**
+     * Only the pointer is queued; the payload itself is shared.
+     */
+    void Update(const Message &message_from_subject) override {
+      enqueued.fetch_add(1);
+      Message dropped_message;
+      while (!queue.TryPush(message_from_subject)) {
+        if (policy == OverflowPolicy::kBlock) {
+          std::this_thread::yield();
+          continue;
+        }
+        while (queue.TryPop(dropped_message)) {
+          dropped.fetch_add(1);
+          if (policy == OverflowPolicy::kDropOldest) {
+            break;
+          }
+        }
+      }
+      wake.fetch_add(1);
+      wake.notify_one();
+    }
+
+    IObserver *observer;
+    BoundedQueue<Message> queue;
+    const OverflowPolicy policy;
+    std::atomic<std::uint32_t> &wake;
+    std::atomic<bool> draining{false};
+    std::atomic<std::uint64_t> enqueued{0};
+    std::atomic<std::uint64_t> delivered{0};
+    std::atomic<std::uint64_t> dropped{0};
+  };
+
+  /**
+   * Checked before mailboxes_ is touched, so a rejected call changes nothing.
+   */
+  void CheckNotNotifying() const {
+    if (fan_out_.Notifying()) {
+      throw std::logic_error("AsyncSubject changed from inside Update");
+    }
+  }
+
+  /**
+   * Worker loop: claims mailboxes nobody else is draining and delivers a
+   * bounded number of messages from each, so one busy observer cannot starve
+   * the others. When a pass delivers nothing, the worker sleeps until a
+   * message has been queued since the pass began.
+   */
+  void Run() {
+    Message message;
+    while (!stop_.load()) {
+      const std::uint32_t seen = wake_.load();
+      bool delivered_any = false;
+      fan_out_.ForEach([&](IObserver *observer) {
+        Mailbox *mailbox = static_cast<Mailbox *>(observer);
+        if (mailbox->draining.exchange(true)) {
+          return;
+        }
+        for (int i = 0; i < 16 && mailbox->queue.TryPop(message); i++) {
+          try {
+            mailbox->observer->Update(message);
+          } catch (const std::exception &e) {
+            std::cerr << "AsyncSubject: Update threw: " << e.what() << "\n";
+          } catch (...) {
+            std::cerr << "AsyncSubject: Update threw an unknown exception\n";
+          }
+          mailbox->delivered.fetch_add(1);
+          delivered_any = true;
+        }
+        mailbox->draining.store(false);
+      });
+      message.reset();
+      if (!delivered_any) {
+        wake_.wait(seen);
+      }
+    }
+  }
+
+  ConcurrentSubject fan_out_;
+  const std::size_t capacity_;
+  const OverflowPolicy policy_;
+  std::mutex mailboxes_mutex_;
+  std::vector<std::unique_ptr<Mailbox>> mailboxes_;
+  std::atomic<bool> stop_;
+  std::atomic<std::uint32_t> wake_{0};
+  std::vector<std::thread> workers_;
+};
+
+/**
+ * A Subject that publishes messages under a topic. It keeps an index from each
+ * topic to a dense array of its subscribers, so publishing touches only the
+ * observers interested in that topic, however many others are attached.
+ * Observers attached without a topic hear every message. Every audience also
+ * remembers where each of its observers sits, so subscribing and
+ * unsubscribing take constant time however large the topic is.
+ */
+class TopicSubject : public ISubject {
+ public:
+  void Attach(IObserver *observer) override {
+    everyone_.Add(observer);
+  }
+  void Detach(IObserver *observer) override {
+    everyone_.Remove(observer);
+  }
+  void Subscribe(IObserver *observer, const std::string &topic) override {
+    topics_[topic].Add(observer);
+  }
+  void Unsubscribe(IObserver *observer, const std::string &topic) override {
+    auto found = topics_.find(topic);
+    if (found == topics_.end()) {
+      return;
+    }
+    found->second.Remove(observer);
+    if (found->second.observers.empty()) {
+      topics_.erase(found);
+    }
+  }
+  /**
+   * Sends the last published message again, to the same audience.
+   */
+  void Notify() override {
+    for (IObserver *observer : everyone_.observers) {
+      observer->Update(message_);
+    }
+    auto found = topics_.find(topic_);
+    if (found != topics_.end()) {
+      for (IObserver *observer : found->second.observers) {
+        observer->Update(message_);
+      }
+    }
+  }
+  void Publish(const std::string &topic, Message message) {
+    topic_ = topic;
+    message_ = std::move(message);
+    Notify();
+  }
+  void Publish(const std::string &topic, std::string message) {
+    Publish(topic, MakeMessage(std::move(message)));
+  }
+
+ private:
+  /**
+   * The observers of one topic, dense for publishing, plus the position of
+   * each. Order among them does not matter, so removal swaps the last one in.
+   */
+  struct Audience {
+    std::vector<IObserver *> observers;
+    std::unordered_map<IObserver *, std::size_t> positions;
+
+    void Add(IObserver *observer) {
+      if (positions.emplace(observer, observers.size()).second) {
+        observers.push_back(observer);
+      }
+    }
+    void Remove(IObserver *observer) {
+      auto found = positions.find(observer);
+      if (found == positions.end()) {
+        return;
+      }
+      const std::size_t position = found->second;
+      positions.erase(found);
+      if (position != observers.size() - 1) {
+        observers[position] = observers.back();
+        positions[observers[position]] = position;
+      }
+      observers.pop_back();
+    }
+  };
+
+  std::unordered_map<std::string, Audience> topics_;
+  Audience everyone_;
+  std::string topic_;
+  Message message_;
+};
+
+/**
+ * An observer that only counts its updates, safe to notify from many threads.
+ */
+class CountingObserver : public IObserver {
+ public:
+  void Update(const std::string &) override {
+    updates_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void Update(const Message &) override {
+    updates_.fetch_add(1, std::memory_order_relaxed);
+  }
+  long updates() const {
+    return updates_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<long> updates_{0};
+};
+
 void ClientCode() {
   Subject *subject = new Subject;
   Observer *observer1 = new Observer(*subject);
@@ -151,7 +1053,164 @@ void ClientCode() {
   delete subject;
 }
 
+/**
+ * Two threads notify while a third keeps subscribing and unsubscribing.
+ */
+void ConcurrentClientCode() {
+  ConcurrentSubject subject;
+  CountingObserver steady;
+  CountingObserver churning;
+  subject.Attach(&steady);
+  subject.CreateMessage("Hello from many threads!");
+
+  std::vector<std::thread> notifiers;
+  for (int i = 0; i < 2; i++) {
+    notifiers.emplace_back([&subject]() {
+      for (int n = 0; n < 1000; n++) {
+        subject.Notify();
+      }
+    });
+  }
+  std::thread subscriber([&subject, &churning]() {
+    for (int n = 0; n < 100; n++) {
+      subject.Attach(&churning);
+      subject.Detach(&churning);
+    }
+  });
+  for (std::thread &notifier : notifiers) {
+    notifier.join();
+  }
+  subscriber.join();
+  std::cout << "The steady observer got " << steady.updates() << " updates from concurrent notifiers.\n";
+}
+
+/**
+ * An observer that takes its time over every update.
+ */
+class SlowObserver : public CountingObserver {
+ public:
+  using CountingObserver::Update;
+  void Update(const Message &message_from_subject) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CountingObserver::Update(message_from_subject);
+  }
+};
+
+/**
+ * A fast and a slow observer share an asynchronous subject; the publisher does
+ * not wait for either of them.
+ */
+void AsyncClientCode() {
+  AsyncSubject subject(2, 16, OverflowPolicy::kCoalesceLatest);
+  CountingObserver fast;
+  SlowObserver slow;
+  subject.Attach(&fast);
+  subject.Attach(&slow);
+  std::chrono::steady_clock::duration publishing{};
+  for (int n = 0; n < 100; n++) {
+    const auto start = std::chrono::steady_clock::now();
+    subject.CreateMessage("Update number " + std::to_string(n));
+    publishing += std::chrono::steady_clock::now() - start;
+    // a feed that produces a message every 100 us
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  std::cout << "Published 100 messages in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(publishing).count()
+            << " us next to an observer that needs 10 ms per message.\n";
+  subject.Flush();
+  for (const AsyncSubject::ObserverLag &lag : subject.Lag()) {
+    std::cout << (lag.observer == &slow ? "Slow" : "Fast") << " observer: " << lag.delivered << " delivered, "
+              << lag.dropped << " coalesced away.\n";
+  }
+  subject.Detach(&fast);
+  subject.Detach(&slow);
+}
+
+/**
+ * Observers that care about a single topic only hear about that topic.
+ */
+void TopicClientCode() {
+  TopicSubject subject;
+  CountingObserver weather;
+  CountingObserver cars;
+  CountingObserver everything;
+  subject.Subscribe(&weather, "weather");
+  subject.Subscribe(&cars, "cars");
+  subject.Attach(&everything);
+  subject.Publish("weather", "The weather is hot today! :p");
+  subject.Publish("weather", MakeMessage(31.5));
+  subject.Publish("cars", "My new car is great! ;)");
+  std::cout << "Topic subscribers got " << weather.updates() << " weather and " << cars.updates()
+            << " car updates; the catch-all observer got " << everything.updates() << ".\n";
+}
+
+/**
+ * A subscription handle detaches its observer when it goes out of scope.
+ */
+void SubscriptionClientCode() {
+  Subject subject;
+  CountingObserver scoped;
+  CountingObserver steady;
+  Subscription keep = subject.Connect(&steady);
+  {
+    Subscription temporary = subject.Connect(&scoped);
+    subject.CreateMessage("Both of you hear this.");
+  }
+  subject.CreateMessage("Only the steady observer hears this.");
+  std::cout << "The scoped observer got " << scoped.updates() << " update, the steady one "
+            << steady.updates() << ".\n";
+}
+
+/**
+ * An observer that wants every change, even when they arrive in batches.
+ */
+class HistoryObserver : public CountingObserver {
+ public:
+  void UpdateBatch(std::span<const Message> messages_from_subject) override {
+    batches_++;
+    for (const Message &message : messages_from_subject) {
+      Update(message);
+    }
+  }
+  long batches() const {
+    return batches_;
+  }
+
+ private:
+  long batches_ = 0;
+};
+
+/**
+ * A subject changing a thousand times notifies its observers ten times.
+ */
+void CoalescingClientCode() {
+  Subject subject;
+  CountingObserver latest;
+  HistoryObserver history;
+  subject.Attach(&latest);
+  subject.Attach(&history);
+  subject.SetCoalescing(100, std::chrono::milliseconds(50));
+  for (long n = 0; n < 1005; n++) {
+    subject.CreateMessage(MakeMessage(n));
+  }
+  // the feed has stopped; the last few changes go out when their window ends
+  if (std::optional<std::chrono::steady_clock::time_point> deadline = subject.FlushDeadline()) {
+    std::this_thread::sleep_until(*deadline);
+    subject.FlushIfDue();
+  }
+  const Subject::CoalescingStats &stats = subject.coalescing_stats();
+  std::cout << stats.changes << " changes went out in " << stats.notifications << " notifications (ratio "
+            << stats.Ratio() << "); the latest-only observer got " << latest.updates()
+            << " updates, the history observer " << history.updates() << " in " << history.batches()
+            << " batches.\n";
+}
+
 int main() {
   ClientCode();
+  ConcurrentClientCode();
+  AsyncClientCode();
+  TopicClientCode();
+  SubscriptionClientCode();
+  CoalescingClientCode();
   return 0;
 }